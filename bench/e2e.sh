@@ -0,0 +1,64 @@
+#!/bin/sh
+#
+# End-to-end benchmark: starts the server on a temporary directory, drives it with many concurrent instances
+# of logClient and checks that every message was logged. Run it from the root of the repository after "make".
+#
+# Usage: bench/e2e.sh [clients] [messages_per_client] [port]
+
+CLIENTS=${1:-50}
+MESSAGES=${2:-200}
+PORT=${3:-$((20000 + $$ % 10000))}
+
+DIR=$(mktemp -d /tmp/logE2E.XXXXXX)
+trap '[ -n "$KEEP" ] || rm -rf "$DIR"' EXIT
+
+# Every client sends the same messages, then "exit" (the client sends CLOSE_CONNECTION)
+i=1
+while [ $i -le "$MESSAGES" ]; do
+	echo "e2e message $i sent by the benchmark client"
+	i=$((i + 1))
+done > "$DIR/messages"
+echo exit >> "$DIR/messages"
+
+./logServer "$PORT" "$DIR/logs" > "$DIR/server.out" 2>&1 &
+SERVER=$!
+sleep 0.5
+
+if ! kill -0 $SERVER 2>/dev/null; then
+	echo "The server did not start:" >&2
+	cat "$DIR/server.out" >&2
+	exit 1
+fi
+
+START=$(date +%s.%N)
+
+CLIENTPIDS=""
+i=1
+while [ $i -le "$CLIENTS" ]; do
+	./logClient 127.0.0.1 "$PORT" < "$DIR/messages" > /dev/null 2>&1 &
+	CLIENTPIDS="$CLIENTPIDS $!"
+	i=$((i + 1))
+done
+
+for pid in $CLIENTPIDS; do
+	wait "$pid"
+done
+
+# Graceful shutdown: the server logs everything it received before terminating
+kill -INT $SERVER
+wait $SERVER
+
+END=$(date +%s.%N)
+
+EXPECTED=$((CLIENTS * MESSAGES))
+LOGGED=$(cat "$DIR"/logs/server_*.log | grep -c -- '--> e2e message')
+
+awk -v c="$CLIENTS" -v m="$MESSAGES" -v l="$LOGGED" -v s="$START" -v e="$END" 'BEGIN {
+	printf "clients: %d, messages per client: %d\n", c, m
+	printf "logged: %d records in %.3f s (%.0f records/s)\n", l, e - s, l / (e - s)
+}'
+
+if [ "$LOGGED" -ne "$EXPECTED" ]; then
+	echo "ERROR: expected $EXPECTED records, found $LOGGED" >&2
+	exit 1
+fi
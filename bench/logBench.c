@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>	/* for close() and rmdir() */
+#include <dirent.h>
+#include <fcntl.h>	/* for the flags to set the access mode */
+#include <sys/stat.h>	/* for the flags to define the file permissions */
+
+#include "logSanitizer.h"
+#include "logFields.h"
+
+/*
+* Microbenchmarks of the functions on the path of every record.
+* Every benchmark is repeated, doubling the number of iterations, until it runs for at least MINTIME seconds.
+* The results (nanoseconds per operation) can be saved with -o and compared with a previous run with -b.
+*/
+
+#define MINTIME 0.5		// minimum duration of every benchmark, in seconds
+#define MAXBENCH 32		// maximum number of benchmarks (and of lines of the baseline file)
+
+// Functions of logServer.c and logsRotation.c (compiled with -DLOGBENCH, i.e. without their main())
+char * get_timestamp(char *t, time_t mt);
+int formatHeader(char *header, size_t size, char *time, char *addr, int pn);
+int logReceivedMessage(char *pathToFile, char *message, char *time, char *addr, int pn, struct logField *fields, int nFields);
+int rotateLogs(char * dir, int maxLogs);
+
+// State shared by the benchmarks
+static char benchDir[] = "/tmp/logBench.XXXXXX";
+static char logPath[300];
+static char message[1024];
+static char sanitized[SANITIZED_SIZE(1024)];
+static size_t messageLength;
+static struct logField fields[MAXFIELDS];
+static int nFields;
+static volatile size_t sink;	// prevents the compiler from removing the benchmarked code
+
+// Baseline of a previous run
+static char baselineNames[MAXBENCH][64];
+static double baselineValues[MAXBENCH];
+static int nBaseline = 0;
+
+static FILE *output = NULL;	// file where the results are saved (-o)
+
+
+/* Returns the current time in seconds */
+static double now(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Runs the benchmark until it lasts at least MINTIME seconds, then prints the time per operation */
+static void runBench(const char *name, void (*fn)(long)) {
+
+	double start, elapsed, ns;
+	long iterations = 1;
+
+	for (;;) {
+		start = now();
+		fn(iterations);
+		elapsed = now() - start;
+		if (elapsed >= MINTIME)
+			break;
+		iterations *= 2;
+	}
+
+	ns = elapsed * 1e9 / iterations;
+	printf("%-28s %12.1f ns/op %14.0f ops/s", name, ns, 1e9 / ns);
+
+	// Comparison with the baseline (lower is better)
+	for (int i = 0; i < nBaseline; i++) {
+		if (strcmp(baselineNames[i], name) == 0) {
+			printf("   %+7.1f%% vs baseline", (ns - baselineValues[i]) * 100 / baselineValues[i]);
+			break;
+		}
+	}
+	printf("\n");
+
+	if (output != NULL)
+		fprintf(output, "%s %.1f\n", name, ns);
+}
+
+
+/* Removes every file of the benchmark directory, then the directory itself */
+static void cleanup(void) {
+
+	char path[600];
+	struct dirent *entry;
+	DIR *d;
+
+	if ((d = opendir(benchDir)) == NULL)
+		return;
+
+	while ((entry = readdir(d)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", benchDir, entry->d_name);
+		remove(path);
+	}
+
+	closedir(d);
+	rmdir(benchDir);
+}
+
+
+/***********************************************************************************************************/
+/* Benchmarks */
+
+static void benchTimestamp(long n) {
+
+	char *t = NULL;
+
+	for (long i = 0; i < n; i++) {
+		t = get_timestamp(t, 0);
+		sink += t[0];
+	}
+}
+
+static void benchSanitize(long n) {
+
+	for (long i = 0; i < n; i++)
+		sink += sanitizeMessage(message, messageLength, sanitized);
+}
+
+static void benchSplitRecords(long n) {
+
+	size_t offset, length;
+
+	for (long i = 0; i < n; i++) {
+		for (offset = 0; offset < messageLength; offset += length + 1) {
+			length = findRecordEnd(message + offset, messageLength - offset);
+			sink += length;
+		}
+	}
+}
+
+static void benchParseFields(long n) {
+
+	for (long i = 0; i < n; i++)
+		sink += parseFields(message, messageLength, fields, MAXFIELDS);
+}
+
+static void benchFormatHeader(long n) {
+
+	char header[100];
+	char *t = get_timestamp(NULL, 0);
+
+	for (long i = 0; i < n; i++)
+		sink += formatHeader(header, sizeof(header), t, "127.0.0.1", 40000 + (int)(i & 1023));
+}
+
+static void benchLogReceivedMessage(long n) {
+
+	char *t = get_timestamp(NULL, 0);
+
+	for (long i = 0; i < n; i++) {
+		if (logReceivedMessage(logPath, sanitized, t, "127.0.0.1", 40000, fields, nFields) == -1)
+			exit(1);
+	}
+}
+
+static void benchRotateLogs(long n) {
+
+	for (long i = 0; i < n; i++)
+		close(rotateLogs(benchDir, 4));
+}
+
+
+/***********************************************************************************************************/
+
+/* Reads the baseline file: one line "<name> <ns/op>" for every benchmark */
+static void readBaseline(const char *path) {
+
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		perror("Error opening the baseline");
+		exit(1);
+	}
+
+	while (nBaseline < MAXBENCH && fscanf(f, "%63s %lf", baselineNames[nBaseline], &baselineValues[nBaseline]) == 2)
+		nBaseline++;
+
+	fclose(f);
+}
+
+
+/* Sets the message used by the following benchmarks */
+static void setMessage(const char *m) {
+
+	snprintf(message, sizeof(message), "%s", m);
+	messageLength = strlen(message);
+	sanitizeMessage(message, messageLength, sanitized);
+	nFields = 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+
+	int opt;
+	char buffer[1024];
+	size_t length;
+
+	while ((opt = getopt(argc, argv, "b:o:")) != -1) {
+		if (opt == 'b')
+			readBaseline(optarg);
+		else if (opt == 'o') {
+			if ((output = fopen(optarg, "w")) == NULL) {
+				perror("Error opening the output file");
+				exit(1);
+			}
+		}
+		else {
+			fprintf(stderr, "Usage: %s [-b <baseline_file>] [-o <output_file>]\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	if (mkdtemp(benchDir) == NULL) {
+		perror("mkdtemp() failed");
+		exit(1);
+	}
+	snprintf(logPath, sizeof(logPath), "%s/server_0.log", benchDir);
+
+	runBench("get_timestamp", benchTimestamp);
+
+	// A typical short message and a message with characters to escape
+	setMessage("GET /index.html status=200 bytes=5120 agent=\"curl/8.4.0\" duration_ms=12 host=web-01");
+	runBench("sanitize_ascii_84B", benchSanitize);
+	setMessage("caf\xc3\xa9 \xe2\x82\xac tab\there \\path\\to\\file bell\x07 invalid\xff end of message");
+	runBench("sanitize_mixed_60B", benchSanitize);
+
+	// Full receive buffer (1 KB) with 16 records of 64 bytes
+	memset(buffer, 'x', sizeof(buffer) - 1);
+	for (length = 63; length < sizeof(buffer) - 1; length += 64)
+		buffer[length] = '\n';
+	buffer[sizeof(buffer) - 1] = '\0';
+	setMessage(buffer);
+	runBench("split_records_1KB", benchSplitRecords);
+
+	setMessage("status=200 method=GET path=/index.html bytes=5120 user=\"John Smith\" duration_ms=12");
+	runBench("parse_fields_kv", benchParseFields);
+	setMessage("{\"status\": 200, \"method\": \"GET\", \"path\": \"/index.html\", \"tags\": [\"a\", \"b\"], \"ok\": true}");
+	runBench("parse_fields_json", benchParseFields);
+
+	runBench("format_header", benchFormatHeader);
+
+	setMessage("GET /index.html status=200 bytes=5120 agent=\"curl/8.4.0\" duration_ms=12 host=web-01");
+	runBench("logReceivedMessage", benchLogReceivedMessage);
+	nFields = parseFields(message, messageLength, fields, MAXFIELDS);
+	runBench("logReceivedMessage_fields", benchLogReceivedMessage);
+
+	runBench("rotateLogs", benchRotateLogs);
+
+	cleanup();
+	if (output != NULL)
+		fclose(output);
+
+	return 0;
+}
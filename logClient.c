@@ -76,7 +76,8 @@ int main(int argc, char *argv[])
 		printf("Enter a message to send to the log server (type 'exit' to quit): ");
 		
 		// fgets() reads also the newline character (\n) at the end when we press enter
-		if (fgets(msgToSend, BUFFSIZE, stdin) == NULL) {
+		// Read at most BUFFSIZE-2 characters: one byte is left for the delimiter appended before sending
+		if (fgets(msgToSend, BUFFSIZE - 1, stdin) == NULL) {
 			perror("error with fgets()");
 			exit(1);
 		}
@@ -87,12 +88,15 @@ int main(int argc, char *argv[])
 		// if the user types 'exit' we exit from the loop and send a request to the server to close the connection
 		if (strcmp(msgToSend, "exit") == 0) {
 			printf("Closing the connection...\n");
-			send(sock_fd, "CLOSE_CONNECTION", 16, 0);
+			send(sock_fd, "CLOSE_CONNECTION\n", 17, 0);
 			break; // exit from while loop
 		}
 		
 		printf("The entered message is: %s\n\n", msgToSend);
 		
+		// Every message is terminated by '\n': the server uses it as record delimiter
+		strcat(msgToSend, "\n");
+		
 		// Send the message to the server
 		if (send(sock_fd, msgToSend, strlen(msgToSend), 0) != strlen(msgToSend)) {
 			perror("A different number of bytes was sent by send()!");
@@ -0,0 +1,482 @@
+#include <stdio.h>
+#include <string.h>	/* for memchr() and strcmp() */
+#include <unistd.h>	/* for write() and close() */
+#include <fcntl.h>	/* for the flags to set the access mode */
+#include <sys/stat.h>	/* for the flags to define the file permissions */
+
+#include "logFields.h"
+#include "logSanitizer.h"	/* for sanitizeMessage() */
+
+#define MAXVALUELEN 1024	// values longer than this are truncated in the column files
+#define PATHSIZE 300		// size of the buffers that hold the path of the dictionary and column files
+
+/*
+* Structured mode
+* When the server is started in structured mode, the fields of every record ("key=value" pairs or a flat JSON object)
+* are extracted at ingest and stored next to the raw text, in a columnar layout:
+* - server_N.log.keys	the dictionary of the keys: line i contains the name of the key with id i
+* - server_N.log.kI	the column of the key with id I: one line "<offset> <value>" for every record that contains it,
+*			where <offset> is the position of the raw record inside server_N.log
+* An aggregation on a single field (e.g. count by status code) only needs to read the dictionary and one column file.
+*
+* The dictionary is cached by every process and reloaded only when a key is not found, since the file only grows.
+* The column files are opened once and kept open for the same log file, so storing a field costs a single write().
+* All the writes happen while the caller holds the lock of the log file, so the dictionary does not need its own lock.
+*/
+static struct {
+	char path[PATHSIZE];		// log file the cache refers to
+	char keys[MAXKEYS][MAXKEYLEN];	// keys[i] is the key with id i
+	int nKeys;			// number of keys in the cache
+	long dictSize;			// number of bytes of the dictionary file already read
+	int columnFd[MAXKEYS];		// columnFd[i] is the open column file of the key with id i (-1 if not open yet)
+} dict;
+
+
+/* Returns 1 if the key is made only of letters, digits, '_', '.' and '-', so that it can be stored in the dictionary */
+static int validKey(const char *key, size_t keyLen) {
+
+	if (keyLen == 0 || keyLen >= MAXKEYLEN)
+		return 0;
+
+	for (size_t i = 0; i < keyLen; i++) {
+		char c = key[i];
+		if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '.' || c == '-'))
+			return 0;
+	}
+	return 1;
+}
+
+
+/*
+* Adds a field to the array if the key is valid and there is still space. Returns the new number of fields.
+* A key repeated in the same record keeps its first value: every record has at most one value per column.
+*/
+static int addField(struct logField *fields, int n, int maxFields, const char *key, size_t keyLen, const char *value, size_t valueLen, int escaped) {
+
+	if (n >= maxFields || !validKey(key, keyLen))
+		return n;
+
+	for (int i = 0; i < n; i++) {
+		if (fields[i].keyLen == keyLen && memcmp(fields[i].key, key, keyLen) == 0)
+			return n;
+	}
+
+	fields[n].key = key;
+	fields[n].keyLen = keyLen;
+	fields[n].value = value;
+	fields[n].valueLen = valueLen;
+	fields[n].escaped = escaped;
+	return n + 1;
+}
+
+
+/* Returns a pointer to the closing quote of the JSON string starting after p, or NULL if the string is not terminated */
+static const char * findStringEnd(const char *p, const char *end) {
+
+	const char *q;
+
+	// memchr() jumps directly to the next quote, then we check that it is not escaped (odd number of backslashes)
+	while ((q = memchr(p, '"', end - p)) != NULL) {
+		const char *b = q;
+		while (b > p && b[-1] == '\\')
+			b--;
+		if (((q - b) & 1) == 0)
+			return q;
+		p = q + 1;
+	}
+	return NULL;
+}
+
+
+/* Parses the records in the form: key=value key2="value with spaces" */
+static int parseKeyValue(const char *p, const char *end, struct logField *fields, int maxFields) {
+
+	int n = 0;
+
+	while (p < end) {
+
+		// Skip the separators
+		while (p < end && *p == ' ')
+			p++;
+		if (p >= end)
+			break;
+
+		// The token ends at the next space (or at the end of the record)
+		const char *tokenEnd = memchr(p, ' ', end - p);
+		if (tokenEnd == NULL)
+			tokenEnd = end;
+
+		const char *eq = memchr(p, '=', tokenEnd - p);
+		if (eq == NULL) {
+			// Not a key=value token (e.g. free text): skip it
+			p = tokenEnd;
+			continue;
+		}
+
+		const char *value = eq + 1;
+		const char *valueEnd = tokenEnd;
+
+		// A quoted value can contain spaces
+		if (value < end && *value == '"') {
+			const char *q = memchr(value + 1, '"', end - value - 1);
+			if (q != NULL) {
+				value++;
+				valueEnd = q;
+				tokenEnd = q + 1;
+			}
+		}
+
+		n = addField(fields, n, maxFields, p, eq - p, value, valueEnd - value, 0);
+		p = tokenEnd;
+	}
+
+	return n;
+}
+
+
+/* Parses a flat JSON object. Nested objects and arrays are stored as raw text */
+static int parseJson(const char *p, const char *end, struct logField *fields, int maxFields) {
+
+	int n = 0;
+
+	p++;	// skip '{'
+
+	while (p < end) {
+
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			p++;
+		if (p >= end || *p == '}')
+			break;
+
+		// Key
+		if (*p != '"')
+			break;	// malformed: keep the fields found so far
+		const char *key = p + 1;
+		const char *keyEnd = findStringEnd(key, end);
+		if (keyEnd == NULL)
+			break;
+
+		p = keyEnd + 1;
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		if (p >= end || *p != ':')
+			break;
+		p++;
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		if (p >= end)
+			break;
+
+		// Value
+		const char *value, *valueEnd;
+		int escaped = 0;
+
+		if (*p == '"') {
+			escaped = 1;
+			value = p + 1;
+			if ((valueEnd = findStringEnd(value, end)) == NULL)
+				break;
+			p = valueEnd + 1;
+		}
+		else if (*p == '{' || *p == '[') {
+			// Skip the nested value counting the brackets (brackets inside strings do not count)
+			int depth = 0;
+			value = p;
+			while (p < end) {
+				if (*p == '"') {
+					const char *q = findStringEnd(p + 1, end);
+					if (q == NULL)
+						break;
+					p = q;
+				}
+				else if (*p == '{' || *p == '[')
+					depth++;
+				else if ((*p == '}' || *p == ']') && --depth == 0) {
+					p++;
+					break;
+				}
+				p++;
+			}
+			valueEnd = p;
+		}
+		else {
+			// Number, true, false or null
+			value = p;
+			while (p < end && *p != ',' && *p != '}' && *p != ' ')
+				p++;
+			valueEnd = p;
+		}
+
+		n = addField(fields, n, maxFields, key, keyEnd - key, value, valueEnd - value, escaped);
+	}
+
+	return n;
+}
+
+
+/*
+* Extracts the fields of a structured record and returns how many were found (0 for free text).
+* If the record starts with '{' it is parsed as a flat JSON object, otherwise as a list of key=value pairs.
+*/
+int parseFields(const char *msg, size_t len, struct logField *fields, int maxFields) {
+
+	const char *p = msg, *end = msg + len;
+
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+
+	if (p < end && *p == '{')
+		return parseJson(p, end, fields, maxFields);
+
+	return parseKeyValue(p, end, fields, maxFields);
+}
+
+
+/* Returns the value of the 4 hexadecimal digits at p, or -1 if they are not valid */
+static long hexValue(const char *p, const char *end) {
+
+	long v = 0;
+
+	if (end - p < 4)
+		return -1;
+	for (int i = 0; i < 4; i++) {
+		char c = p[i];
+		v <<= 4;
+		if (c >= '0' && c <= '9')
+			v |= c - '0';
+		else if (c >= 'a' && c <= 'f')
+			v |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			v |= c - 'A' + 10;
+		else
+			return -1;
+	}
+	return v;
+}
+
+
+/*
+* Decodes the escapes of a JSON string into 'out' (at most outSize bytes) and returns the decoded length.
+* \uXXXX becomes UTF-8 (surrogate pairs included). The decoded text is never longer than the escaped one.
+*/
+static size_t decodeJsonString(const char *in, size_t len, char *out, size_t outSize) {
+
+	const char *p = in, *end = in + len;
+	size_t n = 0;
+	long c, low;
+
+	while (p < end && n < outSize) {
+
+		if (*p != '\\' || p + 1 == end) {
+			out[n++] = *p++;
+			continue;
+		}
+
+		p++;	// skip the backslash
+		switch (*p) {
+			case 'n': c = '\n'; break;
+			case 'r': c = '\r'; break;
+			case 't': c = '\t'; break;
+			case 'b': c = '\b'; break;
+			case 'f': c = '\f'; break;
+			case 'u':
+				if ((c = hexValue(p + 1, end)) == -1) {
+					c = 'u';	// not a valid escape: keep the character
+					break;
+				}
+				p += 4;
+				// A high surrogate followed by a low one is a single character outside the BMP
+				if (c >= 0xD800 && c <= 0xDBFF && end - p > 6 && p[1] == '\\' && p[2] == 'u'
+						&& (low = hexValue(p + 3, end)) >= 0xDC00 && low <= 0xDFFF) {
+					c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+					p += 6;
+				}
+				break;
+			default: c = *p; break;		// \" \\ \/ and unknown escapes
+		}
+		p++;
+
+		// Encode the character in UTF-8 (a lone surrogate is stored as it is: the sanitizer escapes its invalid bytes)
+		if (c < 0x80) {
+			out[n++] = c;
+		}
+		else if (c < 0x800) {
+			if (n + 2 > outSize)
+				break;
+			out[n++] = 0xC0 | (c >> 6);
+			out[n++] = 0x80 | (c & 0x3F);
+		}
+		else if (c < 0x10000) {
+			if (n + 3 > outSize)
+				break;
+			out[n++] = 0xE0 | (c >> 12);
+			out[n++] = 0x80 | ((c >> 6) & 0x3F);
+			out[n++] = 0x80 | (c & 0x3F);
+		}
+		else {
+			if (n + 4 > outSize)
+				break;
+			out[n++] = 0xF0 | (c >> 18);
+			out[n++] = 0x80 | ((c >> 12) & 0x3F);
+			out[n++] = 0x80 | ((c >> 6) & 0x3F);
+			out[n++] = 0x80 | (c & 0x3F);
+		}
+	}
+
+	return n;
+}
+
+
+/* Builds the path of the column file of the given key id */
+void columnPath(char *out, size_t outSize, const char *pathToFile, int keyId) {
+
+	snprintf(out, outSize, "%s.k%d", pathToFile, keyId);
+}
+
+
+/* Reads the keys appended to the dictionary of the log file since the last time it was read */
+static void reloadDictionary(const char *pathToFile) {
+
+	char dictPath[PATHSIZE];
+	char line[MAXKEYLEN + 2];
+	FILE *f;
+
+	// The cache refers to another log file (e.g. after a rotation): close its column files and start from scratch
+	if (strcmp(dict.path, pathToFile) != 0) {
+		for (int i = 0; i < MAXKEYS; i++) {
+			if (dict.path[0] != '\0' && dict.columnFd[i] != -1)
+				close(dict.columnFd[i]);
+			dict.columnFd[i] = -1;
+		}
+		snprintf(dict.path, sizeof(dict.path), "%s", pathToFile);
+		dict.nKeys = 0;
+		dict.dictSize = 0;
+	}
+
+	snprintf(dictPath, sizeof(dictPath), "%s.keys", pathToFile);
+	if ((f = fopen(dictPath, "r")) == NULL)
+		return;	// no dictionary yet
+
+	fseek(f, dict.dictSize, SEEK_SET);
+	while (dict.nKeys < MAXKEYS && fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		snprintf(dict.keys[dict.nKeys++], MAXKEYLEN, "%.*s", MAXKEYLEN - 1, line);
+	}
+	dict.dictSize = ftell(f);
+
+	fclose(f);
+}
+
+
+/* Returns the position of the key inside the cache, or -1 */
+static int findKey(const char *key, size_t keyLen) {
+
+	for (int i = 0; i < dict.nKeys; i++) {
+		if (strncmp(dict.keys[i], key, keyLen) == 0 && dict.keys[i][keyLen] == '\0')
+			return i;
+	}
+	return -1;
+}
+
+
+/* Returns the id of the key, adding it to the dictionary if it is new. Returns -1 if the dictionary is full */
+static int keyId(const char *pathToFile, const char *key, size_t keyLen) {
+
+	char dictPath[PATHSIZE];
+	char line[MAXKEYLEN + 1];
+	int id, fd;
+
+	if (strcmp(dict.path, pathToFile) == 0 && (id = findKey(key, keyLen)) != -1)
+		return id;
+
+	// Another process may have added the key in the meantime
+	reloadDictionary(pathToFile);
+	if ((id = findKey(key, keyLen)) != -1)
+		return id;
+
+	if (dict.nKeys >= MAXKEYS)
+		return -1;
+
+	// New key: append it to the dictionary
+	snprintf(dictPath, sizeof(dictPath), "%s.keys", pathToFile);
+	fd = open(dictPath, O_WRONLY|O_CREAT|O_APPEND, S_IRUSR|S_IWUSR);
+	if (fd == -1) {
+		perror("Error opening the dictionary");
+		return -1;
+	}
+
+	snprintf(line, sizeof(line), "%.*s\n", (int)keyLen, key);
+	if (write(fd, line, keyLen + 1) == -1) {
+		perror("write() failed");
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	snprintf(dict.keys[dict.nKeys], MAXKEYLEN, "%.*s", (int)keyLen, key);
+	dict.dictSize += keyLen + 1;
+	return dict.nKeys++;
+}
+
+
+/* Returns the id of the key inside the dictionary of the log file, or -1 if the key was never stored */
+int lookupKey(const char *pathToFile, const char *key) {
+
+	reloadDictionary(pathToFile);
+	return findKey(key, strlen(key));
+}
+
+
+/*
+* Appends every field of the record to the column file of its key.
+* The record was written at position 'recordOffset' of the log file: the offset is stored with the value,
+* so that the raw record can be found again from the columns.
+*/
+int storeFields(const char *pathToFile, off_t recordOffset, const struct logField *fields, int nFields) {
+
+	char colPath[PATHSIZE];
+	char decoded[MAXVALUELEN];		// value of a JSON string, with its escapes decoded
+	char value[SANITIZED_SIZE(MAXVALUELEN)];
+	char line[sizeof(value) + 32];
+	const char *raw;
+	size_t rawLen;
+	int fd, id, length;
+
+	for (int i = 0; i < nFields; i++) {
+
+		if ((id = keyId(pathToFile, fields[i].key, fields[i].keyLen)) == -1)
+			continue;	// dictionary full: the field is only in the raw text
+
+		// A JSON string is stored decoded, e.g. "a\"b" as a"b, so that it can be searched by its actual value
+		raw = fields[i].value;
+		rawLen = fields[i].valueLen < MAXVALUELEN ? fields[i].valueLen : MAXVALUELEN;
+		if (fields[i].escaped) {
+			rawLen = decodeJsonString(fields[i].value, fields[i].valueLen, decoded, sizeof(decoded));
+			raw = decoded;
+		}
+
+		// The value comes from the client: it is sanitized like the rest of the record
+		sanitizeMessage(raw, rawLen, value);
+		length = snprintf(line, sizeof(line), "%lld %s\n", (long long) recordOffset, value);
+
+		// The column file stays open for the next records (keyId() made the cache refer to this log file)
+		if ((fd = dict.columnFd[id]) == -1) {
+			columnPath(colPath, sizeof(colPath), pathToFile, id);
+			fd = open(colPath, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, S_IRUSR|S_IWUSR);
+			if (fd == -1) {
+				perror("Error opening the column file");
+				return -1;
+			}
+			dict.columnFd[id] = fd;
+		}
+
+		if (write(fd, line, length) != length) {
+			perror("write() failed");
+			close(fd);
+			dict.columnFd[id] = -1;
+			return -1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef LOGFIELDS_H
+#define LOGFIELDS_H
+
+#include <stddef.h>	/* for size_t */
+#include <sys/types.h>	/* for off_t */
+
+#define MAXFIELDS 32		// maximum number of fields extracted from a single record
+#define MAXKEYLEN 64		// maximum length of a key (longer keys are ignored)
+#define MAXKEYS 256		// maximum number of distinct keys in the dictionary of a log file
+
+/*
+* A single field of a structured record. Key and value point inside the received buffer,
+* so they are not null terminated.
+*/
+struct logField {
+	const char *key;
+	size_t keyLen;
+	const char *value;
+	size_t valueLen;
+	int escaped;		// the value is a JSON string: its escapes (\" \\ \n \u00e9 ...) are decoded when it is stored
+};
+
+// Extracts the fields of a "key=value key2=value2" or flat JSON record. Returns the number of fields found
+int parseFields(const char *msg, size_t len, struct logField *fields, int maxFields);
+
+// Appends the fields of the record written at 'recordOffset' of the log file to its column files. The caller holds the log lock
+int storeFields(const char *pathToFile, off_t recordOffset, const struct logField *fields, int nFields);
+
+// Builds the path of the column file of the given key id (e.g. "logs/server_0.log.k3")
+void columnPath(char *out, size_t outSize, const char *pathToFile, int keyId);
+
+// Returns the id of the key inside the dictionary of the log file, or -1 if the key was never stored
+int lookupKey(const char *pathToFile, const char *key);
+
+#endif
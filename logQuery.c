@@ -0,0 +1,468 @@
+#define _GNU_SOURCE		/* for memmem() and strptime() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>	/* for getopt(), sysconf() and close() */
+#include <dirent.h>
+#include <fcntl.h>	/* for the flags to set the access mode */
+#include <pthread.h>
+#include <sys/mman.h>	/* for mmap() */
+#include <sys/stat.h>
+
+#include "logFields.h"	/* for lookupKey() and columnPath() */
+
+#define MAXSEGMENTS 256		// maximum number of log files (segments) of the directory that are queried
+#define MAXTHREADS 64		// maximum number of worker threads
+#define TIMESIZE 24		// length of the timestamp at the beginning of every line, e.g. "Mon Oct 19 17:28:41 2026"
+#define LINESIZE 8192		// a single line of a column file
+#define TIMESLACK 10		// seconds a record can appear after a newer one (see scanSegment())
+
+/*
+* Queries or exports all the log files (segments) of a directory, e.g.
+*   logQuery -f "2026-10-19" -t "2026-10-20" -g timeout logs
+* prints the records of that day that contain "timeout", in timestamp order.
+* Every segment is scanned by a worker thread of a pool, then the matching records of all the segments are merged
+* with a k-way merge (a heap with the next record of every segment), so the scan scales with the number of cores.
+*/
+
+// A record that matched the filters. It points inside the mapped log file
+struct match {
+	time_t time;
+	const char *line;
+	size_t length;		// including the '\n'
+};
+
+// A log file of the directory and the records of it that matched the filters
+struct segment {
+	char path[300];
+	int number;		// N of server_N.log: a lower number is an older file
+	int keyId;		// id of the key of the field filter in this segment (-1 if the key is not there)
+	char *data;		// the file mapped in memory
+	size_t size;
+	struct match *matches;
+	size_t nMatches;
+	size_t next;		// next match to be merged
+};
+
+static struct segment segments[MAXSEGMENTS];
+static int nSegments = 0;
+
+// Filters (the same for every thread, set before the threads are started)
+static time_t fromTime = 0;		// records at or after this time (0: no limit)
+static time_t toTime = 0;		// records before this time (0: no limit)
+static const char *text = NULL;		// substring the record must contain
+static size_t textLength = 0;
+static const char *fieldKey = NULL;	// field filter "key=value"
+static const char *fieldValue = NULL;
+
+// Work queue of the thread pool: the index of the next segment to scan
+static int nextSegment = 0;
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Scans the segments taken from the work queue until it is empty
+static void * worker(void *arg);
+
+// Collects the records of the segment that match the filters
+static void scanSegment(struct segment *s);
+
+// Converts a time given on the command line ("YYYY-MM-DD" or "YYYY-MM-DD HH:MM:SS")
+static time_t parseTimeArgument(const char *arg);
+
+// Moves down the heap the segment at position i
+static void siftDown(int *heap, int n, int i);
+
+int main(int argc, char *argv[])
+{
+
+	char *directory;
+	struct dirent *entry;
+	DIR *d;
+	pthread_t threads[MAXTHREADS];
+	int heap[MAXSEGMENTS];		// min-heap of the segments, ordered by their next match
+	int opt, i, n, number, nameLength;
+	int nThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int countOnly = 0;
+	unsigned long records = 0;
+	struct segment *s;
+
+	while ((opt = getopt(argc, argv, "f:t:g:k:j:c")) != -1) {
+		if (opt == 'f')
+			fromTime = parseTimeArgument(optarg);
+		else if (opt == 't')
+			toTime = parseTimeArgument(optarg);
+		else if (opt == 'g') {
+			text = optarg;
+			textLength = strlen(optarg);
+		}
+		else if (opt == 'k') {
+			// "key=value": the key is split from the value in place
+			char *equal = strchr(optarg, '=');
+			if (equal == NULL) {
+				fprintf(stderr, "The field filter must be key=value\n");
+				exit(1);
+			}
+			*equal = '\0';
+			fieldKey = optarg;
+			fieldValue = equal + 1;
+		}
+		else if (opt == 'j')
+			nThreads = atoi(optarg);
+		else if (opt == 'c')
+			countOnly = 1;
+		else {
+			fprintf(stderr, "Usage: %s [-f <from>] [-t <to>] [-g <text>] [-k <key>=<value>] [-j <threads>] [-c] <directory>\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	if (optind != argc - 1) {
+		fprintf(stderr, "Usage: %s [-f <from>] [-t <to>] [-g <text>] [-k <key>=<value>] [-j <threads>] [-c] <directory>\n", argv[0]);
+		exit(1);
+	}
+	directory = argv[optind];
+
+	if (nThreads < 1)
+		nThreads = 1;
+	if (nThreads > MAXTHREADS)
+		nThreads = MAXTHREADS;
+
+	/* Find the segments: every "server_N.log" of the directory (the column files end with other suffixes) */
+	if ((d = opendir(directory)) == NULL) {
+		perror("opendir() failed");
+		exit(1);
+	}
+
+	while ((entry = readdir(d)) != NULL) {
+
+		nameLength = 0;
+		if (sscanf(entry->d_name, "server_%d.log%n", &number, &nameLength) != 1 || entry->d_name[nameLength] != '\0')
+			continue;
+
+		if (nSegments == MAXSEGMENTS) {
+			fprintf(stderr, "Too many log files, only %d are queried\n", MAXSEGMENTS);
+			break;
+		}
+
+		s = &segments[nSegments++];
+		snprintf(s->path, sizeof(s->path), "%s/%s", directory, entry->d_name);
+		s->number = number;
+
+		// The dictionary of the keys is read here: lookupKey() is not thread safe
+		s->keyId = (fieldKey != NULL) ? lookupKey(s->path, fieldKey) : -1;
+	}
+
+	closedir(d);
+
+	/* Scan the segments in parallel */
+	if (nThreads > nSegments)
+		nThreads = (nSegments > 0) ? nSegments : 1;
+
+	for (i = 0; i < nThreads; i++) {
+		if (pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+			fprintf(stderr, "pthread_create() failed\n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < nThreads; i++)
+		pthread_join(threads[i], NULL);
+
+	/*
+	* K-way merge: the heap contains the segments that still have matches, ordered by the time of their next match
+	* (for the same time, the older segment comes first). The smallest one is printed and the heap is fixed.
+	*/
+	n = 0;
+	for (i = 0; i < nSegments; i++) {
+		if (segments[i].nMatches > 0)
+			heap[n++] = i;
+	}
+	for (i = n / 2 - 1; i >= 0; i--)
+		siftDown(heap, n, i);
+
+	// The export can be large: write it in big blocks
+	setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+	while (n > 0) {
+
+		s = &segments[heap[0]];
+		if (!countOnly)
+			fwrite(s->matches[s->next].line, 1, s->matches[s->next].length, stdout);
+		records++;
+
+		// Move to the next match of the segment, or remove the segment from the heap
+		if (++s->next == s->nMatches)
+			heap[0] = heap[--n];
+		siftDown(heap, n, 0);
+	}
+
+	if (countOnly)
+		printf("%lu\n", records);
+
+	for (i = 0; i < nSegments; i++) {
+		free(segments[i].matches);
+		if (segments[i].data != NULL)
+			munmap(segments[i].data, segments[i].size);
+	}
+
+	return 0;
+}
+
+
+/* Scans the segments taken from the work queue until it is empty */
+static void * worker(void *arg) {
+
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&queueLock);
+		i = nextSegment++;
+		pthread_mutex_unlock(&queueLock);
+
+		if (i >= nSegments)
+			return NULL;
+		scanSegment(&segments[i]);
+	}
+}
+
+
+/* Reads the offsets of the records whose field has the requested value (they are in increasing order) */
+static off_t * readFieldOffsets(struct segment *s, size_t *nOffsets) {
+
+	char colPath[350];
+	char line[LINESIZE];
+	char *value;
+	off_t *offsets = NULL;
+	size_t allocated = 0;
+	FILE *f;
+
+	*nOffsets = 0;
+	columnPath(colPath, sizeof(colPath), s->path, s->keyId);
+	if ((f = fopen(colPath, "r")) == NULL)
+		return NULL;
+
+	// Every line is "<offset> <value>"
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		if ((value = strchr(line, ' ')) == NULL || strcmp(value + 1, fieldValue) != 0)
+			continue;
+
+		if (*nOffsets == allocated) {
+			allocated = allocated ? 2 * allocated : 1024;
+			if ((offsets = realloc(offsets, allocated * sizeof(off_t))) == NULL) {
+				perror("realloc() failed");
+				exit(1);
+			}
+		}
+		offsets[(*nOffsets)++] = strtoll(line, NULL, 10);
+	}
+
+	fclose(f);
+	return offsets;
+}
+
+
+/* Used by qsort() to order the matches of a segment by time, then by position in the file */
+static int compareMatches(const void *a, const void *b) {
+
+	const struct match *x = a, *y = b;
+
+	if (x->time != y->time)
+		return (x->time < y->time) ? -1 : 1;
+	return (x->line < y->line) ? -1 : (x->line > y->line);
+}
+
+
+/* Collects the records of the segment that match the filters */
+static void scanSegment(struct segment *s) {
+
+	struct stat file_info;
+	struct tm tm;
+	char timestamp[TIMESIZE + 1];
+	char lastTimestamp[TIMESIZE + 1] = "";
+	time_t lastTime = 0;
+	time_t minuteTime = 0;		// time of the minute of lastTimestamp (i.e. at 0 seconds)
+	size_t allocated = 0, length;
+	off_t *offsets = NULL;
+	size_t nOffsets = 0, nextOffset = 0;
+	char *line, *end, *nl, *found;
+	int fd;
+
+	// With a field filter, a segment without the key has no matches
+	if (fieldKey != NULL) {
+		if (s->keyId == -1)
+			return;
+		if ((offsets = readFieldOffsets(s, &nOffsets)) == NULL)
+			return;
+	}
+
+	if ((fd = open(s->path, O_RDONLY)) == -1) {
+		perror("Error opening the log file");
+		free(offsets);
+		return;
+	}
+	if (fstat(fd, &file_info) == -1 || file_info.st_size == 0) {
+		close(fd);
+		free(offsets);
+		return;
+	}
+
+	s->size = file_info.st_size;
+	s->data = mmap(NULL, s->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (s->data == MAP_FAILED) {
+		perror("mmap() failed");
+		s->data = NULL;
+		free(offsets);
+		return;
+	}
+	madvise(s->data, s->size, MADV_SEQUENTIAL);
+
+	end = s->data + s->size;
+	for (line = s->data; line < end; line = nl + 1) {
+
+		/*
+		* Jump to the next line that can match, without looking at the others:
+		* with a field filter the column file gives the offset of every matching record,
+		* with a substring filter the next occurrence is searched in the rest of the file.
+		*/
+		if (offsets != NULL) {
+			// Skip the repeated offsets (a key repeated in a record, in the column files written by older versions)
+			while (nextOffset > 0 && nextOffset < nOffsets && offsets[nextOffset] <= offsets[nextOffset - 1])
+				nextOffset++;
+			if (nextOffset == nOffsets)
+				break;		// no more matching records in this segment
+			if (offsets[nextOffset] < 0 || offsets[nextOffset] >= (off_t) s->size)
+				break;
+			line = s->data + offsets[nextOffset++];
+			if (line > s->data && line[-1] != '\n') {
+				nl = line;	// not the beginning of a record: the column file does not belong to this log file
+				continue;
+			}
+		}
+		else if (text != NULL) {
+			if ((found = memmem(line, end - line, text, textLength)) == NULL)
+				break;
+			if ((nl = memrchr(line, '\n', found - line)) != NULL)
+				line = nl + 1;
+		}
+
+		// A line without '\n' is still being written by the server: it is left out
+		if ((nl = memchr(line, '\n', end - line)) == NULL)
+			break;
+		length = nl - line + 1;
+
+		/*
+		* Every line starts with the timestamp written by ctime(). Consecutive lines often share it, or differ only in
+		* the seconds: the slow strptime() and mktime() are only used when the minute changes.
+		*/
+		if (length > TIMESIZE && memcmp(line, lastTimestamp, TIMESIZE) != 0) {
+			if (memcmp(line, lastTimestamp, 17) == 0 && memcmp(line + 19, lastTimestamp + 19, TIMESIZE - 19) == 0
+					&& line[17] >= '0' && line[17] <= '5' && line[18] >= '0' && line[18] <= '9') {
+				lastTime = minuteTime + (line[17] - '0') * 10 + (line[18] - '0');
+				memcpy(lastTimestamp, line, TIMESIZE);
+			}
+			else {
+				memcpy(timestamp, line, TIMESIZE);
+				timestamp[TIMESIZE] = '\0';
+				memset(&tm, 0, sizeof(tm));
+				if (strptime(timestamp, "%a %b %d %H:%M:%S %Y", &tm) != NULL) {
+					tm.tm_isdst = -1;
+					lastTime = mktime(&tm);
+					minuteTime = lastTime - tm.tm_sec;
+					memcpy(lastTimestamp, timestamp, TIMESIZE + 1);
+				}
+			}
+		}
+
+		/*
+		* The records of a segment are almost in time order: the server takes the timestamp before waiting for the lock,
+		* so a record can be written after a newer one. The scan ends only TIMESLACK seconds after the range.
+		*/
+		if (toTime != 0 && lastTime >= toTime) {
+			if (lastTime >= toTime + TIMESLACK)
+				break;
+			continue;
+		}
+		if (lastTime < fromTime)
+			continue;
+
+		if (text != NULL && memmem(line, length - 1, text, textLength) == NULL)
+			continue;
+
+		if (s->nMatches == allocated) {
+			allocated = allocated ? 2 * allocated : 1024;
+			if ((s->matches = realloc(s->matches, allocated * sizeof(struct match))) == NULL) {
+				perror("realloc() failed");
+				exit(1);
+			}
+		}
+		s->matches[s->nMatches].time = lastTime;
+		s->matches[s->nMatches].line = line;
+		s->matches[s->nMatches].length = length;
+		s->nMatches++;
+	}
+
+	free(offsets);
+
+	// The k-way merge needs the matches of the segment in time order: sort them if some record is out of place
+	for (size_t i = 1; i < s->nMatches; i++) {
+		if (s->matches[i].time < s->matches[i - 1].time) {
+			qsort(s->matches, s->nMatches, sizeof(struct match), compareMatches);
+			break;
+		}
+	}
+}
+
+
+/* Converts a time given on the command line ("YYYY-MM-DD" or "YYYY-MM-DD HH:MM:SS", local time) */
+static time_t parseTimeArgument(const char *arg) {
+
+	struct tm tm;
+	const char *rest;
+
+	memset(&tm, 0, sizeof(tm));
+	if ((rest = strptime(arg, "%Y-%m-%d %H:%M:%S", &tm)) == NULL || *rest != '\0') {
+		memset(&tm, 0, sizeof(tm));
+		if ((rest = strptime(arg, "%Y-%m-%d", &tm)) == NULL || *rest != '\0') {
+			fprintf(stderr, "Invalid time '%s' (use YYYY-MM-DD or \"YYYY-MM-DD HH:MM:SS\")\n", arg);
+			exit(1);
+		}
+	}
+
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
+
+/* True if the next match of segment a comes before the one of segment b (same time: the older segment first) */
+static int before(int a, int b) {
+
+	struct segment *x = &segments[a], *y = &segments[b];
+	time_t tx = x->matches[x->next].time, ty = y->matches[y->next].time;
+
+	if (tx != ty)
+		return tx < ty;
+	return x->number < y->number;
+}
+
+
+/* Moves down the heap the segment at position i, until it comes before both its children */
+static void siftDown(int *heap, int n, int i) {
+
+	int smallest, child, tmp;
+
+	for (;;) {
+		smallest = i;
+		for (child = 2 * i + 1; child <= 2 * i + 2 && child < n; child++) {
+			if (before(heap[child], heap[smallest]))
+				smallest = child;
+		}
+		if (smallest == i)
+			return;
+
+		tmp = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = tmp;
+		i = smallest;
+	}
+}
@@ -0,0 +1,519 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>	/* for errno */
+#include <signal.h>	/* for sigaction() */
+#include <time.h>	/* for clock_gettime() */
+#include <unistd.h>	/* for pread(), pwrite(), close() and sleep() */
+#include <poll.h>	/* for poll() */
+#include <dirent.h>
+#include <fcntl.h>	/* for the flags to set the access mode */
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>	/* for struct timeval */
+
+#include <netinet/in.h>
+#include <arpa/inet.h>	/* for inet_addr() and inet_ntoa() */
+
+#include "logReplication.h"
+
+#define NAMESIZE 256		// maximum length of the name of a replicated file
+#define LINESIZE 512		// maximum length of a protocol header
+#define PASSBATCHES 16		// DATA frames sent by the leader before checking the ACKs again
+#define IOTIMEOUT 1		// seconds after which a blocking send()/recv() of the leader returns, to check if it must stop
+
+/*
+* Log replication
+* The leader runs a dedicated process that periodically scans the log directory and sends to the follower the bytes
+* appended to every file since the last scan. The log files (and the column files of the structured mode) are only
+* ever appended to, so the state of the follower is fully described by the size of each of its files.
+*/
+
+// State of a file replicated by the leader
+struct replFile {
+	char name[NAMESIZE];
+	off_t sent;		// bytes sent to the follower
+	off_t acked;		// bytes the follower confirmed to have written
+};
+
+// The list grows as needed: in structured mode every log file has its dictionary and up to MAXKEYS column files
+static struct replFile *files = NULL;
+static int nFiles = 0;
+
+// Buffer of the data received from the socket and not consumed yet (one connection per process at a time)
+static char inBuf[REPL_BATCH];
+static size_t inLen = 0;
+
+// Set by SIGTERM: the leader sends what is left, waits for the ACKs and terminates
+static volatile sig_atomic_t stopRequested = 0;
+static time_t stopDeadline = 0;		// when the leader gives up sending the last data
+
+// True when the stop was requested more than REPL_STOPTIMEOUT seconds ago
+static int stopExpired(void);
+
+
+/* Sends the whole buffer. Returns 0 on success, -1 if the connection was lost */
+static int sendAll(int sock, const char *buf, size_t len) {
+
+	ssize_t n;
+
+	while (len > 0) {
+		// MSG_NOSIGNAL: if the peer closed the connection we get an error instead of SIGPIPE
+		if ((n = send(sock, buf, len, MSG_NOSIGNAL)) <= 0) {
+			// Interrupted by a signal or by the timeout of the socket: retry, unless the leader must stop now
+			if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) && !stopExpired())
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+
+/*
+* Reads a line (without the '\n') from the socket.
+* Returns 1 if a line was read, 0 if no complete line is available yet (only with MSG_DONTWAIT), -1 if the connection was lost.
+*/
+static int readLine(int sock, char *line, size_t size, int flags) {
+
+	char *nl;
+	ssize_t n;
+
+	while ((nl = memchr(inBuf, '\n', inLen)) == NULL) {
+
+		// A header longer than the buffer is a protocol error
+		if (inLen == sizeof(inBuf))
+			return -1;
+
+		if ((n = recv(sock, inBuf + inLen, sizeof(inBuf) - inLen, flags)) < 0) {
+			if ((flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return 0;
+			// Interrupted by a signal or by the timeout of the socket: retry, unless the leader must stop now
+			if ((errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) && !stopExpired())
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			return -1;
+		inLen += n;
+	}
+
+	size_t lineLen = nl - inBuf;
+	snprintf(line, size, "%.*s", (int) lineLen, inBuf);
+
+	// Remove the line from the buffer
+	inLen -= lineLen + 1;
+	memmove(inBuf, nl + 1, inLen);
+	return 1;
+}
+
+
+/* Reads exactly len bytes from the socket (first from the data already buffered). Returns 0 on success, -1 on error */
+static int recvExact(int sock, char *buf, size_t len) {
+
+	size_t fromBuf = (inLen < len) ? inLen : len;
+	ssize_t n;
+
+	memcpy(buf, inBuf, fromBuf);
+	inLen -= fromBuf;
+	memmove(inBuf, inBuf + fromBuf, inLen);
+
+	for (size_t got = fromBuf; got < len; got += n) {
+		if ((n = recv(sock, buf + got, len - got, 0)) < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n <= 0)
+			return -1;
+	}
+	return 0;
+}
+
+
+/* Only plain names of the log directory can be replicated (no paths, no hidden files) */
+static int validName(const char *name) {
+
+	return name[0] != '\0' && name[0] != '.' && strchr(name, '/') == NULL && strlen(name) < NAMESIZE;
+}
+
+
+/***********************************************************************************************************/
+/* Leader */
+
+/*
+* Returns the state of the given file, adding it if it is new. Returns NULL if the list cannot grow.
+* The pointers returned before are no longer valid after a file is added.
+*/
+static struct replFile * getFile(const char *name) {
+
+	struct replFile *newList;
+
+	for (int i = 0; i < nFiles; i++) {
+		if (strcmp(files[i].name, name) == 0)
+			return &files[i];
+	}
+
+	if (nFiles % 64 == 0) {
+		if ((newList = realloc(files, (nFiles + 64) * sizeof(struct replFile))) == NULL) {
+			perror("realloc() failed");
+			return NULL;
+		}
+		files = newList;
+	}
+
+	snprintf(files[nFiles].name, NAMESIZE, "%s", name);
+	files[nFiles].sent = 0;
+	files[nFiles].acked = 0;
+	return &files[nFiles++];
+}
+
+
+/* Signal handler of SIGTERM in the leader: it only sets a flag, the main loop does the rest */
+static void requestStop(int sig) {
+
+	stopRequested = 1;
+}
+
+
+/* Returns the seconds elapsed since an arbitrary point (not affected by changes of the system clock) */
+static time_t monotonicSeconds(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+
+/* True when the stop was requested more than REPL_STOPTIMEOUT seconds ago: the leader gives up */
+static int stopExpired(void) {
+
+	if (!stopRequested)
+		return 0;
+	if (stopDeadline == 0)
+		stopDeadline = monotonicSeconds() + REPL_STOPTIMEOUT;
+	return monotonicSeconds() >= stopDeadline;
+}
+
+
+/* True if the follower confirmed every byte sent so far */
+static int allAcked(void) {
+
+	for (int i = 0; i < nFiles; i++) {
+		if (files[i].acked < files[i].sent)
+			return 0;
+	}
+	return 1;
+}
+
+
+/* Connects to the follower. Returns the socket descriptor, or -1 if the follower is not reachable */
+static int connectToFollower(char *followerIP, unsigned short followerPort) {
+
+	int sock;
+	struct sockaddr_in target_addr;
+
+	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		perror("socket() failed");
+		return -1;
+	}
+
+	target_addr.sin_family = AF_INET;
+	target_addr.sin_addr.s_addr = inet_addr(followerIP);
+	target_addr.sin_port = htons(followerPort);
+	memset(&(target_addr.sin_zero), '\0', 8);
+
+	/*
+	* The blocking operations on the socket (connect() included) return after IOTIMEOUT seconds at most, so that
+	* a follower that does not answer cannot keep the leader from stopping
+	*/
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &(struct timeval){IOTIMEOUT, 0}, sizeof(struct timeval)) < 0
+			|| setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &(struct timeval){IOTIMEOUT, 0}, sizeof(struct timeval)) < 0) {
+		perror("setsockopt() failed");
+		close(sock);
+		return -1;
+	}
+
+	if (connect(sock, (struct sockaddr *) &target_addr, sizeof(target_addr)) < 0) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+
+/*
+* Sends the data appended to the files of the directory since the last call, at most PASSBATCHES frames.
+* Returns the number of frames sent, or -1 if the connection was lost.
+*/
+static int shipNewData(int sock, char *directory) {
+
+	static char data[REPL_BATCH];
+	char header[LINESIZE];
+	char path[NAMESIZE + 300];
+	struct dirent *entry;
+	struct stat file_info;
+	struct replFile *f;
+	DIR *d;
+	int fd, frames = 0;
+	ssize_t n;
+
+	if ((d = opendir(directory)) == NULL) {
+		perror("opendir() failed");
+		return 0;
+	}
+
+	while (frames < PASSBATCHES && (entry = readdir(d)) != NULL) {
+
+		if (!validName(entry->d_name))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+		if (stat(path, &file_info) == -1 || !S_ISREG(file_info.st_mode))
+			continue;
+
+		if ((f = getFile(entry->d_name)) == NULL || f->sent >= file_info.st_size)
+			continue;	// nothing new in this file
+
+		if ((fd = open(path, O_RDONLY)) == -1)
+			continue;
+
+		// Send the new bytes in batches of at most REPL_BATCH bytes, without waiting for the ACKs
+		while (frames < PASSBATCHES && f->sent < file_info.st_size) {
+
+			n = pread(fd, data, sizeof(data), f->sent);
+			if (n <= 0)
+				break;
+
+			snprintf(header, sizeof(header), "DATA %s %lld %lld\n", f->name, (long long) f->sent, (long long) n);
+			if (sendAll(sock, header, strlen(header)) == -1 || sendAll(sock, data, n) == -1) {
+				close(fd);
+				closedir(d);
+				return -1;
+			}
+
+			f->sent += n;
+			frames++;
+		}
+
+		close(fd);
+	}
+
+	closedir(d);
+	return frames;
+}
+
+
+/*
+* Streams every file of the directory to the follower, reconnecting when the connection is lost.
+* On SIGTERM it sends the data not replicated yet and terminates when the follower acknowledged all of it
+* (or after REPL_STOPTIMEOUT seconds, if the follower is not reachable or does not answer).
+*/
+void runReplicationLeader(char *directory, char *followerIP, unsigned short followerPort) {
+
+	char line[LINESIZE];
+	char name[NAMESIZE];
+	long long size;
+	struct replFile *f;
+	struct pollfd p;
+	struct sigaction sa;
+	int sock, frames, ret;
+
+	// No SA_RESTART: a blocking connect() or poll() is interrupted, so that the stop is noticed at once
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = requestStop;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+
+	for (;;) {
+
+		if (stopExpired()) {
+			printf("[-] Replication stopped: the follower is not reachable\n");
+			exit(1);
+		}
+
+		if ((sock = connectToFollower(followerIP, followerPort)) == -1) {
+			if (!stopExpired())
+				sleep(1);	// retry later
+			continue;
+		}
+
+		// New connection: the follower tells us what it already has
+		inLen = 0;
+		nFiles = 0;
+		while ((ret = readLine(sock, line, sizeof(line), 0)) == 1 && strcmp(line, "END") != 0) {
+			if (sscanf(line, "HAVE %255s %lld", name, &size) == 2 && (f = getFile(name)) != NULL) {
+				f->sent = size;
+				f->acked = size;
+			}
+		}
+		if (ret == -1) {
+			close(sock);
+			if (!stopExpired())
+				sleep(1);
+			continue;
+		}
+
+		printf("[+] Replicating to the follower %s:%d\n", followerIP, followerPort);
+
+		for (;;) {
+
+			if ((frames = shipNewData(sock, directory)) == -1)
+				break;
+
+			// Stop requested: terminate only when nothing is left to send and the follower has written everything
+			if (stopRequested) {
+				if (frames == 0 && allAcked()) {
+					printf("[-] Replication stopped: the follower is up to date\n");
+					close(sock);
+					exit(0);
+				}
+				if (stopExpired()) {
+					printf("[-] Replication stopped before the follower was up to date\n");
+					close(sock);
+					exit(1);
+				}
+			}
+
+			// Collect the ACKs. If nothing was sent, wait a little for new data in the directory
+			p.fd = sock;
+			p.events = POLLIN;
+			if (poll(&p, 1, (frames > 0) ? 0 : 100) > 0) {
+				while ((ret = readLine(sock, line, sizeof(line), MSG_DONTWAIT)) == 1) {
+					if (sscanf(line, "ACK %255s %lld", name, &size) == 2 && (f = getFile(name)) != NULL)
+						f->acked = size;
+				}
+				if (ret == -1)
+					break;
+			}
+		}
+
+		printf("[-] Connection with the follower lost, reconnecting...\n");
+		close(sock);
+		if (!stopExpired())
+			sleep(1);
+	}
+}
+
+
+/***********************************************************************************************************/
+/* Follower */
+
+/* Sends the list of the files of the directory with their size, so that the leader knows where to resume */
+static int sendHaveList(int sock, char *directory) {
+
+	char line[LINESIZE];
+	char path[NAMESIZE + 300];
+	struct dirent *entry;
+	struct stat file_info;
+	DIR *d;
+
+	if ((d = opendir(directory)) != NULL) {
+		while ((entry = readdir(d)) != NULL) {
+
+			if (!validName(entry->d_name))
+				continue;
+
+			snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+			if (stat(path, &file_info) == -1 || !S_ISREG(file_info.st_mode))
+				continue;
+
+			snprintf(line, sizeof(line), "HAVE %s %lld\n", entry->d_name, (long long) file_info.st_size);
+			if (sendAll(sock, line, strlen(line)) == -1) {
+				closedir(d);
+				return -1;
+			}
+		}
+		closedir(d);
+	}
+
+	return sendAll(sock, "END\n", 4);
+}
+
+
+/* Receives the DATA frames of the leader and appends them to the files. Returns when the connection is lost */
+static void followLeader(int sock, char *directory) {
+
+	static char data[REPL_BATCH];
+	char line[LINESIZE];
+	char name[NAMESIZE];
+	char path[NAMESIZE + 300];
+	long long offset, length;
+	struct stat file_info;
+	off_t skip;
+	int fd;
+
+	while (readLine(sock, line, sizeof(line), 0) == 1) {
+
+		if (sscanf(line, "DATA %255s %lld %lld", name, &offset, &length) != 3 || !validName(name)
+				|| offset < 0 || length <= 0 || length > REPL_BATCH) {
+			fprintf(stderr, "Invalid replication header: %s\n", line);
+			return;
+		}
+
+		if (recvExact(sock, data, length) == -1)
+			return;
+
+		snprintf(path, sizeof(path), "%s/%s", directory, name);
+		if ((fd = open(path, O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR)) == -1) {
+			perror("Error opening the replicated file");
+			return;
+		}
+		if (fstat(fd, &file_info) == -1) {
+			perror("fstat() failed");
+			close(fd);
+			return;
+		}
+
+		// A gap means that we missed some data: drop the connection, the leader will resume from our size
+		if (offset > file_info.st_size) {
+			fprintf(stderr, "Gap in %s (have %lld, received %lld)\n", name, (long long) file_info.st_size, offset);
+			close(fd);
+			return;
+		}
+
+		// Write only the bytes we do not have yet
+		skip = file_info.st_size - offset;
+		if (skip < length && pwrite(fd, data + skip, length - skip, file_info.st_size) != length - skip) {
+			perror("pwrite() failed");
+			close(fd);
+			return;
+		}
+		close(fd);
+
+		snprintf(line, sizeof(line), "ACK %s %lld\n", name, offset + length);
+		if (sendAll(sock, line, strlen(line)) == -1)
+			return;
+	}
+}
+
+
+/* Accepts the leader on the listening socket and writes the replicated files in the directory. Never returns */
+void runReplicationFollower(int listenSocket, char *directory) {
+
+	struct sockaddr_in leader_address;
+	unsigned int leaderAddrLength;
+	int sock;
+
+	for (;;) {
+
+		leaderAddrLength = sizeof(leader_address);
+		if ((sock = accept(listenSocket, (struct sockaddr *) &leader_address, &leaderAddrLength)) < 0) {
+			perror("accept() failed");
+			exit(1);
+		}
+
+		printf("[+] Leader connected from %s port %d\n", inet_ntoa(leader_address.sin_addr), ntohs(leader_address.sin_port));
+
+		inLen = 0;
+		if (sendHaveList(sock, directory) == 0)
+			followLeader(sock, directory);
+
+		printf("[-] Leader disconnected\n");
+		close(sock);
+	}
+}
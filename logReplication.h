@@ -0,0 +1,24 @@
+#ifndef LOGREPLICATION_H
+#define LOGREPLICATION_H
+
+/*
+* Replication protocol between a leader and a follower log server (text headers, binary data):
+*
+*   follower -> leader	"HAVE <file> <size>\n" for every file it already has, then "END\n"
+*   leader -> follower	"DATA <file> <offset> <length>\n" followed by <length> bytes of the file
+*   follower -> leader	"ACK <file> <size>\n" after writing the received data
+*
+* The leader sends many DATA frames without waiting for the ACKs (pipelining). After a disconnection the follower
+* sends again its HAVE list, so the leader resumes every file from the offset the follower already has.
+*/
+
+#define REPL_BATCH 65536	// maximum number of bytes sent in a single DATA frame
+#define REPL_STOPTIMEOUT 10	// seconds given to the leader to send the last data when it is asked to stop
+
+// Streams every file of the directory to the follower at the given address. On SIGTERM it catches up and terminates
+void runReplicationLeader(char *directory, char *followerIP, unsigned short followerPort);
+
+// Accepts the leader on the listening socket and writes the replicated files in the directory. Never returns
+void runReplicationFollower(int listenSocket, char *directory);
+
+#endif
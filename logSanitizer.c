@@ -0,0 +1,151 @@
+#include <string.h>	/* for memchr() and memcpy() */
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>	/* for the SSE2/AVX2 intrinsics */
+#endif
+
+#include "logSanitizer.h"
+
+/*
+* The log file is line oriented: every record is a single line. A payload received from a client could contain
+* newlines, null bytes or other control characters, which would corrupt the file or allow a client to forge
+* records on behalf of another one. For this reason every message goes through sanitizeMessage() before being logged.
+*
+* Most messages are plain printable ASCII, so the hot loop checks 32 (AVX2) or 16 (SSE2) bytes at a time and copies
+* them unchanged. Only when a chunk contains a byte that needs attention we fall back to the scalar code,
+* which validates the UTF-8 sequences and escapes what is not allowed.
+*/
+
+static const char hexDigits[] = "0123456789abcdef";
+
+
+/* Returns the index of the first record delimiter ('\n') inside buf, or len if the buffer does not contain one */
+size_t findRecordEnd(const char *buf, size_t len) {
+
+	// memchr() of the C library is already vectorized, there is no need to write our own loop
+	const char *nl = memchr(buf, '\n', len);
+
+	return (nl == NULL) ? len : (size_t)(nl - buf);
+}
+
+
+/*
+* Returns the length of the valid UTF-8 sequence starting at s (at most 'left' bytes available), or 0 if the
+* sequence is not valid (truncated, overlong encoding, surrogate or code point greater than U+10FFFF).
+*/
+static size_t utf8SequenceLength(const unsigned char *s, size_t left) {
+
+	size_t n;
+	unsigned int cp;
+
+	if (s[0] >= 0xC2 && s[0] <= 0xDF) { n = 2; cp = s[0] & 0x1F; }
+	else if (s[0] >= 0xE0 && s[0] <= 0xEF) { n = 3; cp = s[0] & 0x0F; }
+	else if (s[0] >= 0xF0 && s[0] <= 0xF4) { n = 4; cp = s[0] & 0x07; }
+	else return 0;	// continuation byte, 0xC0/0xC1 (always overlong) or 0xF5-0xFF
+
+	if (left < n)
+		return 0;
+
+	for (size_t i = 1; i < n; i++) {
+		// Every following byte must be a continuation byte (10xxxxxx)
+		if ((s[i] & 0xC0) != 0x80)
+			return 0;
+		cp = (cp << 6) | (s[i] & 0x3F);
+	}
+
+	// Reject overlong encodings, UTF-16 surrogates and values outside the Unicode range
+	if ((n == 3 && cp < 0x800) || (n == 4 && cp < 0x10000))
+		return 0;
+	if ((cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF)
+		return 0;
+
+	return n;
+}
+
+
+/*
+* Copies the message into out escaping:
+* - backslashes as "\\" (so that escapes cannot be forged by the client)
+* - newline, carriage return and tab as "\n", "\r", "\t"
+* - any other control character and every byte that is not part of a valid UTF-8 sequence as "\xHH"
+* The output is always null terminated. 'out' must be at least SANITIZED_SIZE(len) bytes long.
+*/
+size_t sanitizeMessage(const char *in, size_t len, char *out) {
+
+	const unsigned char *s = (const unsigned char *) in;
+	size_t i = 0, o = 0;
+
+	while (i < len) {
+
+#if defined(__AVX2__)
+		// Fast path: 32 printable ASCII bytes (0x20-0x7e, no backslash) are copied as they are
+		while (len - i >= 32) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+			// Bytes >= 0x80 are negative in a signed comparison, so they are caught by the first test
+			__m256i bad = _mm256_or_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v),
+					_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f)),
+							_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))));
+			if (_mm256_movemask_epi8(bad) != 0)
+				break;
+			_mm256_storeu_si256((__m256i *)(out + o), v);
+			i += 32;
+			o += 32;
+		}
+#endif
+#if defined(__SSE2__)
+		// Same as above, 16 bytes at a time
+		while (len - i >= 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+			__m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, _mm_set1_epi8(0x20)),
+					_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)),
+							_mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))));
+			if (_mm_movemask_epi8(bad) != 0)
+				break;
+			_mm_storeu_si128((__m128i *)(out + o), v);
+			i += 16;
+			o += 16;
+		}
+#endif
+		if (i >= len)
+			break;
+
+		// Slow path: a single character (or UTF-8 sequence)
+		unsigned char c = s[i];
+
+		if (c >= 0x20 && c < 0x7f && c != '\\') {
+			out[o++] = c;
+			i++;
+		}
+		else if (c == '\\') {
+			out[o++] = '\\';
+			out[o++] = '\\';
+			i++;
+		}
+		else if (c == '\n' || c == '\r' || c == '\t') {
+			out[o++] = '\\';
+			out[o++] = (c == '\n') ? 'n' : (c == '\r') ? 'r' : 't';
+			i++;
+		}
+		else {
+			size_t n = (c >= 0x80) ? utf8SequenceLength(s + i, len - i) : 0;
+
+			if (n > 0) {
+				// Valid multi-byte character: copy it unchanged
+				memcpy(out + o, s + i, n);
+				o += n;
+				i += n;
+			}
+			else {
+				// Control character or invalid byte
+				out[o++] = '\\';
+				out[o++] = 'x';
+				out[o++] = hexDigits[c >> 4];
+				out[o++] = hexDigits[c & 0x0F];
+				i++;
+			}
+		}
+	}
+
+	out[o] = '\0';
+	return o;
+}
@@ -0,0 +1,18 @@
+#ifndef LOGSANITIZER_H
+#define LOGSANITIZER_H
+
+#include <stddef.h>	/* for size_t */
+
+/*
+* Worst case expansion of sanitizeMessage(): every input byte may become a 4 bytes escape sequence (\xHH).
+* The output buffer must be at least SANITIZED_SIZE(len) bytes long (the +1 is for the null terminator).
+*/
+#define SANITIZED_SIZE(len) (4 * (len) + 1)
+
+// Returns the index of the first record delimiter ('\n') inside buf, or len if the buffer does not contain one
+size_t findRecordEnd(const char *buf, size_t len);
+
+// Copies the message into out escaping control characters, backslashes and invalid UTF-8 bytes. Returns the output length
+size_t sanitizeMessage(const char *in, size_t len, char *out);
+
+#endif
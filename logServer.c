@@ -3,39 +3,89 @@
 #include <string.h>	/* for memset() */
 #include <signal.h>
 #include <time.h>
+#include <errno.h>	/* for errno */
+#include <limits.h>	/* for PATH_MAX */
+#include <poll.h>	/* for poll() */
 
 #include <sys/socket.h> /* for socket(), bind(), connect() */
 #include <sys/types.h>
 #include <sys/wait.h>	/* for waitpid() */
+#include <sys/signalfd.h>	/* for signalfd() */
+#include <sys/uio.h>	/* for writev() */
+#include <sys/ioctl.h>	/* for ioctl() and FIONREAD */
 #include <unistd.h> 	/* for close() */
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>	/* for the TCP keepalive options */
 #include <arpa/inet.h>  /* for sockaddr_in and inet_ntoa() */
 
 #include <dirent.h>
 #include <fcntl.h>	/* for the flags to set the access mode  */
 #include <sys/stat.h>	/* for the flags to define the file permissions */
 
-#define MAXQUEUE 3
+#include "logSanitizer.h"	/* for sanitizeMessage() and findRecordEnd() */
+#include "logFields.h"		/* for parseFields() and storeFields() */
+#include "logReplication.h"	/* for runReplicationLeader() and runReplicationFollower() */
+
+#define MAXQUEUE 128		// pending connections: with a short queue the connections of a burst of clients are delayed or lost
 #define MAXLOGFILE 5		// maximum number of log files in the given directory
+#define RECVSIZE 1024		// size of the buffer used by recv()
+#define HEADERSIZE 100		// timestamp and address of the client at the beginning of every line of the log file
+#define LINESIZE (SANITIZED_SIZE(RECVSIZE) + HEADERSIZE)	// a single line of the log file (sanitized message + header)
+#define IDLE_TIMEOUT 600	// default number of seconds without data after which a connection is closed
+#define HANDSHAKE_TIMEOUT 60	// seconds given to a new client to send its first message
+#define KEEPALIVE_IDLE 60	// seconds of silence before the kernel starts probing a connection
+#define KEEPALIVE_INTERVAL 10	// seconds between two probes
+#define KEEPALIVE_COUNT 5	// unanswered probes after which the connection is considered dead
+#define LISTENFD_ENV "LOGSERVER_LISTEN_FD"	// environment variable used to pass the listening socket to the new server (hot restart)
+#define LOGFILE_ENV "LOGSERVER_LOG_FILE"	// environment variable used to pass the current log file to the new server (hot restart)
+#define READYFD_ENV "LOGSERVER_READY_FD"	// environment variable used to pass the pipe where the new server reports that it is ready
+#define RESTART_TIMEOUT 10	// seconds given to the new server to get ready (hot restart)
+#define SHUTDOWN_ACCEPT 2	// at shutdown, seconds (at most) spent accepting the connections already queued
+
+// Values of 'stopping'
+#define SHUTDOWN 1		// SIGINT/SIGTERM: drain the connections and terminate
+#define RESTART 2		// SIGHUP: a new server took the listening socket, serve the current connections and terminate
 
 // Global variables
-char *directory;		// directory to store the log file (global to be accessible by sign. handler)
-char fullpath[50];		// full path to the log file (global to be accessible by sign. handler)
-int is_main_process = 1;	// to distinguish between parent and child
+char *directory;		// directory to store the log file
+char fullpath[50];		// full path to the log file
+char exePath[PATH_MAX];		// absolute path of the executable, started again by the hot restart
+pid_t *children = NULL;		// PIDs of the child processes that are serving a client
+int nChildren = 0;		// number of elements of 'children'
+int structured_mode = 0;	// when set, the fields of every record are also stored in the column files
+int follower_mode = 0;		// when set, the server only receives the log files replicated by a leader
+pid_t replicationPID = 0;	// process that replicates the log directory (leader mode), 0 when it is not running
 
 // Helper function to compute the current time to put in the log file
 char * get_timestamp(char *t, time_t mt);
 
+// Writes the beginning of a line of the log file (timestamp and address of the client). Returns its length
+int formatHeader(char *header, size_t size, char *time, char *addr, int pn);
+
 // Function that logs the received message inside the log file, implementing the advisory locking mechanism
-int logReceivedMessage(char *pathToFile, char *message, char *time, char *addr, int pn);
+int logReceivedMessage(char *pathToFile, char *message, char *time, char *addr, int pn, struct logField *fields, int nFields);
 
 // Function similar to the one above, used to log a general message in the log file
 int logMessage(char *pathToFile, char *message, char *time);
 
-// Signal handler for the SIGINT signal (Ctrl+C)
-void shutdown_handler(int signum);
+// Adds a child process to the list of the children serving a client
+void addChild(pid_t pid);
+
+// Waits for the terminated child processes (non-blocking) and removes them from the list
+void reapChildren(void);
+
+// Starts a new server process that inherits the listening socket and waits until it is ready (hot restart)
+int restartServer(char *argv[], int serverSocket);
+
+// Enables the TCP keepalive on a client socket, so that dead peers are detected by the kernel
+int setKeepAlive(int sock);
+
+// Returns the seconds elapsed since an arbitrary point (not affected by changes of the system clock)
+time_t monotonicSeconds(void);
 
+/* main() is left out when the functions of this file are linked into the benchmarks (see the Makefile) */
+#ifndef LOGBENCH
 int main(int argc, char *argv[])
 {
 
@@ -55,22 +105,103 @@ int main(int argc, char *argv[])
 	unsigned int clientAddrLength;		// length of client_address structure
 	
 	pid_t processID;			// Process ID returned by fork()
+	int ret;				// value returned by poll()
 	
-	char buffer[1024];			// buffer where to write the data read by recv()
+	char buffer[RECVSIZE];			// buffer where to write the data read by recv()
 	int recv_length;			// number of bytes written in the buffer by recv()
 	
-	time_t mytime;				// to get the timestamp for the log file
-	char *t;
+	char record[SANITIZED_SIZE(RECVSIZE)];	// a single record of the buffer, after sanitization
+	size_t offset, recordLength;		// position and length of the current record inside the buffer
+	size_t pending;				// bytes of an incomplete record kept at the start of the buffer
+	size_t received;			// bytes in the buffer (pending + received by the last recv())
+	int closeRequested;			// set when the client sends CLOSE_CONNECTION
+	int clientGone;				// set when the client closed the connection
+	int draining;				// set when the child has to log what it received and terminate
+	int drainLeft;				// bytes still to read while draining (-1 = not known yet)
+	int timedOut;				// set when the client was silent for too long
+	int handshakeDone;			// set when the client sent its first data
+	int idleTimeout = IDLE_TIMEOUT;		// seconds without data after which a connection is closed (0 = never)
+	time_t lastActivity;			// when the child last received data (monotonic seconds)
+	time_t remaining;			// seconds left before the timeout of the connection
+	int pollTimeout;			// timeout of poll() in milliseconds (-1 = infinite)
+	
+	struct logField fields[MAXFIELDS];	// fields of the current record (structured mode)
+	int nFields;				// number of fields of the current record
+	
+	char followerAddr[64];			// "<IP_address>:<port>" of the follower (leader mode)
+	char *followerIP = NULL;		// address of the follower (leader mode)
+	unsigned short followerPort = 0;	// port of the follower (leader mode)
+	char *colon;
+	int usageError = 0;
+	
+	char *inheritedSocket;			// listening socket passed by the previous server (hot restart)
+	char *inheritedLogFile;			// log file passed by the previous server (hot restart)
+	char *readyPipe;			// pipe where we report to the previous server that we are ready (hot restart)
+	int readyFd = -1;			// descriptor of that pipe (-1 if we were not started by a hot restart)
+	sigset_t mask;				// signals read through the signalfd
+	int sfd;				// signalfd descriptor
+	struct signalfd_siginfo si;		// signal read from the signalfd
+	struct pollfd pfd[2];			// descriptors watched by poll()
+	int stopping = 0;			// 0, SHUTDOWN or RESTART
+	int listening = 1;			// set while the listening socket is open
+	time_t acceptDeadline = 0;		// at shutdown, when the server stops accepting the queued connections
+	char stopMessage[100];			// last message of the log file
+	
+	time_t mytime = 0;			// to get the timestamp for the log file
+	char *t = NULL;
 
-	/* Check correct number of arguments */
-	if (argc != 3) {
-		fprintf(stderr, "Usage: %s <listening_port> <directory>\n", argv[0]);
+	/* Check correct number of arguments and the options */
+	for (i = 3; i < (unsigned int) argc; i++) {
+		if (strcmp(argv[i], "-s") == 0)
+			structured_mode = 1;
+		else if (strcmp(argv[i], "-f") == 0)
+			follower_mode = 1;
+		else if (strcmp(argv[i], "-t") == 0 && i + 1 < (unsigned int) argc)
+			idleTimeout = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-r") == 0 && i + 1 < (unsigned int) argc) {
+			// "-r <IP_address>:<port>": split a copy of the argument (argv is reused as it is by the hot restart)
+			snprintf(followerAddr, sizeof(followerAddr), "%s", argv[++i]);
+			if ((colon = strchr(followerAddr, ':')) == NULL) {
+				usageError = 1;
+				continue;
+			}
+			*colon = '\0';
+			followerIP = followerAddr;
+			followerPort = atoi(colon + 1);
+			
+			// Check if the IPv4 address (dotted-notation) of the follower is valid, otherwise the leader would retry forever
+			if (inet_aton(followerIP, &(struct in_addr){0}) == 0 || followerPort == 0) {
+				fprintf(stderr, "Follower address not valid: %s\n", argv[i]);
+				exit(1);
+			}
+		}
+		else
+			usageError = 1;
+	}
+	
+	if (argc < 3 || usageError || (follower_mode && (structured_mode || followerIP != NULL))) {
+		fprintf(stderr, "Usage: %s <listening_port> <directory> [-s] [-r <follower_IP>:<follower_port>] [-t <idle_seconds>]\n", argv[0]);
+		fprintf(stderr, "       %s <replication_port> <directory> -f\n", argv[0]);
+		fprintf(stderr, "  -s  structured mode: store the key=value/JSON fields of every record in column files\n");
+		fprintf(stderr, "  -r  leader mode: replicate the log directory to the follower at the given address\n");
+		fprintf(stderr, "  -f  follower mode: receive the log directory of a leader on the given port\n");
+		fprintf(stderr, "  -t  close the connections silent for more than the given seconds (default %d, 0 = never)\n", IDLE_TIMEOUT);
 		exit(1);
 	}
 	
 	serverPort = atoi(argv[1]);		// first argument
 	directory = argv[2];			// second argument
 	
+	/*
+	* Remember the path of the executable for the hot restart. It is made absolute but the symbolic links are not resolved:
+	* after a deploy (a new file or a new link with the same name) the restart runs the new version.
+	* A name without '/' was found in the PATH, and it will be searched again in the same way.
+	*/
+	if (strchr(argv[0], '/') == NULL || argv[0][0] == '/' || getcwd(exePath, sizeof(exePath)) == NULL)
+		snprintf(exePath, sizeof(exePath), "%s", argv[0]);
+	else
+		snprintf(exePath + strlen(exePath), sizeof(exePath) - strlen(exePath), "/%s", argv[0]);
+	
 	/**********************************************************************************/
 	
 	/* Check if the given directory exists */
@@ -89,7 +220,14 @@ int main(int argc, char *argv[])
 	
 	/* When started the server should open a new log file (without removing any old file) */
 	
-	for (i = 0; i <= MAXLOGFILE; i++) {
+	// After a hot restart the server continues the log file of the previous one, without taking a new one
+	if ((inheritedLogFile = getenv(LOGFILE_ENV)) != NULL) {
+		snprintf(fullpath, sizeof(fullpath), "%s", inheritedLogFile);
+		unsetenv(LOGFILE_ENV);
+	}
+	
+	// A follower does not write its own log file: the directory contains only the files of the leader
+	for (i = 0; !follower_mode && inheritedLogFile == NULL && i <= MAXLOGFILE; i++) {
 	
 		
 		/*
@@ -113,57 +251,205 @@ int main(int argc, char *argv[])
 	
 	// If the directory contains the maximum number of possible log files then we terminate.
 	// 'i' will be equal to MAXLOGFILE only if we did not exit from the for loop through the break.
-	if (i == MAXLOGFILE) {
+	if (!follower_mode && inheritedLogFile == NULL && i == MAXLOGFILE) {
 		perror("Max number of log files reached!");
 		exit(1);
 	}
 	
 	/**********************************************************************************/
+	/* Hot restart: the previous server passed us its listening socket, which is already bound and listening */
 	
-	// Register the signal handler for SIGINT signal
-	if (signal(SIGINT, shutdown_handler) == SIG_ERR) {
-		perror("signal() failed");
-		exit(1);
+	if ((inheritedSocket = getenv(LISTENFD_ENV)) != NULL) {
+		serverSocket = atoi(inheritedSocket);
+		unsetenv(LISTENFD_ENV);
+		printf("[+] Listening socket inherited from the previous server\n");
+		
+		/*
+		* The previous server waits on this pipe until we report that we are ready, or until we terminate (end of file).
+		* No other process must keep it open: the processes forked before the report close it, and it is close-on-exec.
+		*/
+		if ((readyPipe = getenv(READYFD_ENV)) != NULL) {
+			readyFd = atoi(readyPipe);
+			fcntl(readyFd, F_SETFD, FD_CLOEXEC);
+			unsetenv(READYFD_ENV);
+		}
 	}
+	else {
 	
-	/**********************************************************************************/
-	/* (1) Create a socket for incoming connections */
+		/**********************************************************************************/
+		/* (1) Create a socket for incoming connections */
 	
-	// Creates a socket specifying the domain (Internet), the type (Stream) and protocol (0 for TCP). Returns a descriptor.
-	if ((serverSocket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		perror("socket() failed");
-		exit(1);
+		// Creates a socket specifying the domain (Internet), the type (Stream) and protocol (0 for TCP). Returns a descriptor.
+		if ((serverSocket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+			perror("socket() failed");
+			exit(1);
+		}
+	
+		// Allow the server to be restarted immediately on the same port (e.g. a follower after a crash)
+		if (setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
+			perror("setsockopt() failed");
+			exit(1);
+		}
+	
+		/**********************************************************************************/
+		/* (2) Bind the socket to an IP address and to the port number specified in the command line */
+	
+		// Construct local address structure
+		server_address.sin_family = AF_INET;		// Internet address familiy
+		server_address.sin_addr.s_addr = INADDR_ANY;	// Any address of the machine
+		server_address.sin_port = htons(serverPort);
+		memset(&(server_address.sin_zero), '\0', 8); 	// Zero the rest of the struct
+	
+		// Bind to the local address
+		if (bind(serverSocket, (struct sockaddr *) &server_address, sizeof(server_address)) < 0) {
+			perror("bind() failed");
+			exit(1);
+		}
+	
+		/**********************************************************************************/
+		/* (3) Listen for incoming connections from clients */
+	
+		// specify willingness to accept incoming connections and a queue limit for pending connections
+		if (listen(serverSocket, MAXQUEUE)) {
+			perror("listen() failed");
+			exit(1);
+		}
 	}
 	
 	/**********************************************************************************/
-	/* (2) Bind the socket to an IP address and to the port number specified in the command line */
+	/* Replication */
 	
-	// Construct local address structure
-	server_address.sin_family = AF_INET;		// Internet address familiy
-	server_address.sin_addr.s_addr = INADDR_ANY;	// Any address of the machine
-	server_address.sin_port = htons(serverPort);
-	memset(&(server_address.sin_zero), '\0', 8); 	// Zero the rest of the struct
+	// In follower mode the listening socket is used by the leader: the follower only writes what it receives
+	if (follower_mode) {
+		printf("[+] Waiting for the leader on port %d\n", serverPort);
+		runReplicationFollower(serverSocket, directory);
+	}
 	
-	// Bind to the local address
-	if (bind(serverSocket, (struct sockaddr *) &server_address, sizeof(server_address)) < 0) {
-		perror("bind() failed");
-		exit(1);
+	// In leader mode a dedicated child process streams the log directory to the follower
+	if (followerIP != NULL) {
+		fflush(stdout);
+		if ((processID = fork()) < 0) {
+			perror("fork() failed");
+			exit(1);
+		}
+		else if (processID == 0) {
+			// Ctrl+C is sent to all the processes: the replication stops only when the server asks it (SIGTERM)
+			signal(SIGINT, SIG_IGN);
+			close(serverSocket);
+			if (readyFd != -1)
+				close(readyFd);
+			runReplicationLeader(directory, followerIP, followerPort);
+		}
+		replicationPID = processID;
 	}
 	
 	/**********************************************************************************/
-	/* (3) Listen for incoming connections from clients */
+	/* Signals */
+	
+	/*
+	* The signals are not handled by an asynchronous signal handler: they are blocked and read from a descriptor
+	* (signalfd) in the main loop, together with the new connections. In this way the shutdown runs in the normal
+	* context of the process, where ctime(), printf() and the log functions can be used safely.
+	* SIGINT/SIGTERM --> graceful shutdown, SIGHUP --> hot restart, SIGCHLD --> a child process terminated
+	*/
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGCHLD);
+	
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+		perror("sigprocmask() failed");
+		exit(1);
+	}
 	
-	// specify willingness to accept incoming connections and a queue limit for pending connections
-	if (listen(serverSocket, MAXQUEUE)) {
-		perror("listen() failed");
+	// SFD_CLOEXEC: the descriptor is not inherited by the new server in case of hot restart
+	if ((sfd = signalfd(-1, &mask, SFD_CLOEXEC)) == -1) {
+		perror("signalfd() failed");
 		exit(1);
 	}
 	
+	// Hot restart: everything is ready, the previous server can stop accepting the connections
+	if (readyFd != -1) {
+		if (write(readyFd, "R", 1) != 1)
+			perror("Error reporting to the previous server");
+		close(readyFd);
+		readyFd = -1;
+	}
+	
 	/**********************************************************************************/
 	/* (4) Accept a connection / Wait for a client to connect */
 	
-	for (;;) { // Accept loop
+	pfd[0].fd = sfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = serverSocket;
+	pfd[1].events = POLLIN;
+	
+	// Accept loop: it ends when a shutdown or a restart was requested and every child process has terminated
+	while (listening || nChildren > 0) {
 	
+		/*
+		* When the listening socket is closed only the signalfd is watched.
+		* During a shutdown the connections already in the queue of the listening socket are still accepted (without
+		* waiting for new ones): their clients may have already sent all their messages.
+		*/
+		if ((ret = poll(pfd, listening ? 2 : 1, (stopping == SHUTDOWN && listening) ? 0 : -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll() failed");
+			exit(1);
+		}
+		
+		/*
+		* Shutdown and no more queued connections: stop accepting and ask every child to log what it received and terminate.
+		* The clients that keep connecting cannot delay the shutdown for more than SHUTDOWN_ACCEPT seconds.
+		*/
+		if (stopping == SHUTDOWN && listening && (ret == 0 || monotonicSeconds() >= acceptDeadline)) {
+			close(serverSocket);
+			listening = 0;
+			for (i = 0; i < (unsigned int) nChildren; i++)
+				kill(children[i], SIGTERM);
+			continue;
+		}
+		
+		if (pfd[0].revents & POLLIN) {
+		
+			if (read(sfd, &si, sizeof(si)) != sizeof(si)) {
+				perror("read() failed");
+				exit(1);
+			}
+			
+			if (si.ssi_signo == SIGCHLD) {
+				// Wait for the terminated children (no zombie processes are left)
+				reapChildren();
+			}
+			else if (si.ssi_signo == SIGHUP && stopping == 0) {
+				// Hot restart: the new server accepts the next connections, we keep serving the current ones
+				if (restartServer(argv, serverSocket) == -1) {
+					printf("\nThe new server did not start: this one keeps accepting the connections\n");
+					continue;
+				}
+				printf("\nRestarting the server: %d connection(s) still served by the old process\n", nChildren);
+				close(serverSocket);
+				listening = 0;
+				stopping = RESTART;
+			}
+			else if ((si.ssi_signo == SIGINT || si.ssi_signo == SIGTERM) && stopping != SHUTDOWN) {
+				// Graceful shutdown: the children are drained as soon as the queued connections have been accepted
+				printf("\nShutting down the server: draining the connections...\n");
+				acceptDeadline = monotonicSeconds() + SHUTDOWN_ACCEPT;
+				if (!listening) {
+					for (i = 0; i < (unsigned int) nChildren; i++)
+						kill(children[i], SIGTERM);
+				}
+				stopping = SHUTDOWN;
+			}
+			continue;
+		}
+		
+		if (!(pfd[1].revents & POLLIN))
+			continue;
+		
 		// size of client_address structure
 		clientAddrLength = sizeof(client_address);
 		
@@ -179,9 +465,14 @@ int main(int argc, char *argv[])
 		// newSocket is now connected to a client
 		printf("Server: got connection from %s port %d\n", inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
 		
+		// A client that disappears without closing the connection (crash, network failure) is detected by the keepalive
+		if (setKeepAlive(newSocket) == -1) {
+			perror("setsockopt() failed");
+		}
+		
 		t = get_timestamp(t, mytime);
 		// Record the new connection on the log file
-		if ((logReceivedMessage(fullpath, "NEW Connection established", t, inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port))) == -1) {
+		if ((logReceivedMessage(fullpath, "NEW Connection established", t, inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port), NULL, 0)) == -1) {
 					perror("Error while logging the new connection");
 					exit(1);
 				}
@@ -190,76 +481,189 @@ int main(int argc, char *argv[])
 		
 		// Fork a child process: it will handle the client requests
 		
+		// Flush stdout first, otherwise the child would print again what is still in the buffer
+		fflush(stdout);
+		
 		if ((processID = fork()) < 0) {
 			perror("fork() failed");
 			exit(1);
 		}
 		else if (processID == 0) { // if this is the child process
 		
-			// Set to 0 (for the signal handler)
-			is_main_process = 0;
-			
 			// Child closes parent socket
 			close(serverSocket); 
 			
 			/**********************************************************************************/
 			
-			/* Child handles the client *	
+			/* Child handles the client */
 			
 			/* Loop that receives data from the connected client and prints it out. */
-			while (1) {
+			closeRequested = 0;
+			clientGone = 0;
+			draining = 0;
+			drainLeft = -1;
+			timedOut = 0;
+			handshakeDone = 0;
+			pending = 0;
+			lastActivity = monotonicSeconds();
+			
+			// pfd[0] is still the signalfd: in the child it returns the signals sent to the child
+			pfd[1].fd = newSocket;
+			
+			while (!closeRequested && !clientGone) {
 			
 				/*
-				* The recv() function is given a pointer to a buffer and a maximum length to read from
-				* the socket. The function writes the data into the buffer passed to it and returns the
-				* number of bytes it actually wrote.
+				* Idle connections: a new client must send something within HANDSHAKE_TIMEOUT seconds, then the connection
+				* is closed after idleTimeout seconds without data. Every child has a single connection, so the deadline
+				* is just the timeout of poll().
 				*/
-				if ((recv_length = recv(newSocket, buffer, 1024, 0)) < 0) {
-					perror("recv() failed");
+				pollTimeout = -1;
+				if (draining) {
+					pollTimeout = 0;
+				}
+				else if (idleTimeout > 0) {
+					remaining = lastActivity - monotonicSeconds();
+					remaining += (!handshakeDone && HANDSHAKE_TIMEOUT < idleTimeout) ? HANDSHAKE_TIMEOUT : idleTimeout;
+					if (remaining <= 0) {
+						printf("Closing the idle connection with %s:%d\n", inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
+						timedOut = 1;
+						draining = 1;
+						pollTimeout = 0;
+					}
+					else {
+						pollTimeout = remaining * 1000;
+					}
+				}
+				
+				// Wait for data or for a signal. While draining, only the data already received is read (no waiting)
+				if (poll(pfd, 2, pollTimeout) < 0) {
+					if (errno == EINTR)
+						continue;
+					perror("poll() failed");
 					exit(1);
 				}
+				
+				if ((pfd[0].revents & POLLIN) && read(sfd, &si, sizeof(si)) == sizeof(si)
+						&& (si.ssi_signo == SIGINT || si.ssi_signo == SIGTERM)) {
+					printf("Shutdown requested: logging the pending records of %s:%d\n", inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
+					draining = 1;
+				}
+				
+				if (!draining && !(pfd[1].revents & (POLLIN|POLLHUP|POLLERR)))
+					continue;
 			
-				// Check if the client requested to close the connection
-				if (strcmp(buffer, "CLOSE_CONNECTION") == 0) {
-					printf("Received close signal. Closing connection...\n");
-					t = get_timestamp(t, mytime);
-					// Log the disconnection
-					if ((logReceivedMessage(fullpath, buffer, t, inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port))) == -1) {
-					perror("Error while logging the disconnection");
-					exit(1);
+				/*
+				* While draining, only the data already queued when the drain started is read: a client that keeps
+				* sending cannot delay the shutdown. FIONREAD returns the number of bytes waiting in the socket.
+				*/
+				if (draining && drainLeft == -1 && ioctl(newSocket, FIONREAD, &drainLeft) == -1)
+					drainLeft = 0;
+				
+				/*
+				* The recv() function is given a pointer to a buffer and a maximum length to read from
+				* the socket. The function writes the data into the buffer passed to it and returns the
+				* number of bytes it actually wrote.
+				*/
+				if (draining && drainLeft == 0) {
+					recv_length = 0;	// everything queued was read: disconnect as if the client left
 				}
-					
-					break; // exit from while loop to disconnect
+				else if ((recv_length = recv(newSocket, buffer + pending, (draining && drainLeft < (int) (RECVSIZE - pending)) ? (size_t) drainLeft : RECVSIZE - pending, draining ? MSG_DONTWAIT : 0)) < 0) {
+					// While draining, EAGAIN means that everything was read: we disconnect as if the client left
+					if (draining && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+						recv_length = 0;
+					}
+					// The connection was reset or the keepalive probes were not answered: the client is gone
+					else if (errno == ECONNRESET || errno == ETIMEDOUT) {
+						printf("Connection with %s:%d lost\n", inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
+						recv_length = 0;
+					}
+					else {
+						perror("recv() failed");
+						exit(1);
+					}
 				}
 				
-				// Print the received number of bytes
-				printf("RECV: %d bytes\n", recv_length);
+				if (draining && recv_length > 0)
+					drainLeft -= recv_length;
 				
-				t = get_timestamp(t, mytime);
+				// recv() returns 0 when the client closed the connection without sending CLOSE_CONNECTION
+				if (recv_length == 0) {
+					if (pending == 0)
+						break;
+					clientGone = 1;	// log the last incomplete record, then disconnect
+				}
+				else {
+					// Print the received number of bytes
+					printf("RECV: %d bytes\n", recv_length);
+					lastActivity = monotonicSeconds();
+					handshakeDone = 1;
+				}
 				
-				// print time, client address and port number
-				printf("%s | from %s port %d --> ", t, inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
+				received = pending + recv_length;
+				pending = 0;
 				
 				/*
-				* Print the received message.
-				* By using %.*s, we provide the width as an argument, ensuring that only the
-				* specified number of data (the length of the received data) are printed.
-				* This is a safe way to handle non null-terminated string.
+				* The buffer may contain more than one record (messages are terminated by '\n') and it is
+				* not null terminated. Each record is sanitized and logged separately, so that a client
+				* cannot inject newlines or control characters in the log file.
 				*/
-				printf("%.*s\n\n", (int)recv_length, buffer);
+				for (offset = 0; offset < received; offset += recordLength + 1) {
 				
-				// Log the message inside the log file
-				if ((logReceivedMessage(fullpath, buffer, t, inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port))) == -1) {
-					perror("Error while logging the received message");
+					recordLength = findRecordEnd(buffer + offset, received - offset);
+					
+					/*
+					* The last record of the buffer may be missing its delimiter because the rest has not been received yet:
+					* it is moved to the start of the buffer and completed by the next recv(). A record as big as the
+					* whole buffer (or the last one sent before the client disconnected) is logged as it is.
+					*/
+					if (offset + recordLength == received && recordLength < RECVSIZE && !clientGone) {
+						memmove(buffer, buffer + offset, recordLength);
+						pending = recordLength;
+						break;
+					}
+					
+					// Skip empty records (e.g. consecutive delimiters)
+					if (recordLength == 0)
+						continue;
+					
+					sanitizeMessage(buffer + offset, recordLength, record);
+					
+					t = get_timestamp(t, mytime);
+					
+					// Check if the client requested to close the connection
+					if (strcmp(record, "CLOSE_CONNECTION") == 0) {
+						printf("Received close signal. Closing connection...\n");
+						// Log the disconnection
+						if ((logReceivedMessage(fullpath, record, t, inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port), NULL, 0)) == -1) {
+							perror("Error while logging the disconnection");
+							exit(1);
+						}
+						
+						closeRequested = 1;
+						break; // exit from the for loop, then from the while loop to disconnect
+					}
+					
+					// print time, client address, port number and the received message
+					printf("%s | from %s port %d --> %s\n\n", t, inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port), record);
+					
+					// In structured mode the fields are parsed from the raw record (the sanitizer would alter the JSON escapes)
+					nFields = structured_mode ? parseFields(buffer + offset, recordLength, fields, MAXFIELDS) : 0;
+					
+					// Log the message inside the log file
+					if ((logReceivedMessage(fullpath, record, t, inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port), fields, nFields)) == -1) {
+						perror("Error while logging the received message");
+						exit(1);
+					}
+				}
+			}
+			
+			// Record that the server closed the connection
+			if (timedOut) {
+				t = get_timestamp(t, mytime);
+				if ((logReceivedMessage(fullpath, "IDLE Connection closed by the server", t, inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port), NULL, 0)) == -1) {
+					perror("Error while logging the idle timeout");
 					exit(1);
 				}
-				
-				/*
-				* Clear the buffer array before using it to receive other data from the client.
-				* By setting all the bytes to zero, we ensure that there will not be any previous
-				* data left in the buffer.
-				*/
-				memset(buffer, 0, sizeof(buffer));
 			}
 			
 			// child closes client socket
@@ -279,24 +683,46 @@ int main(int argc, char *argv[])
 			
 			/*
 			* To avoid zombie processes (processes that have terminated but still have an entry in the process table)
-			* and properly release the resources, the parent process should wait for its child process.
+			* and properly release the resources, the parent process waits for its children when it receives SIGCHLD.
+			* The list of the children is needed to drain them at shutdown.
 			*/
-			
-			// Wait for any terminated child process, without storing status info, return immediately if no child has exited (non-blocking wait)
-			if ((waitpid(-1, NULL, WNOHANG)) < 0) {
-				perror("waitpid() failed");
-				exit(1);
-			}
+			addChild(processID);
 		
 		}
 		
-	} // end of for loop
+	} // end of accept loop
 	
 	/**********************************************************************************/
 	
-	// Never executed
+	t = get_timestamp(t, mytime);
+	
+	// Record the shutdown in the log file
+	snprintf(stopMessage, sizeof(stopMessage), "The server was %s", (stopping == RESTART) ? "restarted" : "shut down");
+	if (logMessage(fullpath, stopMessage, t) == -1) {
+		perror("Error while logging the shutdown message");
+		exit(1);
+	}
+	
+	// Every record was written: the replication sends what is left to the follower, then terminates
+	if (replicationPID > 0) {
+		printf("Waiting for the replication to the follower...\n");
+		fflush(stdout);
+		kill(replicationPID, SIGTERM);
+		
+		// The leader gives up after REPL_STOPTIMEOUT seconds: if it is still running a second later, it is stuck
+		for (i = 0; i < (REPL_STOPTIMEOUT + 1) * 10 && waitpid(replicationPID, NULL, WNOHANG) == 0; i++)
+			usleep(100000);
+		if (i == (REPL_STOPTIMEOUT + 1) * 10) {
+			printf("The replication did not stop: killing it\n");
+			kill(replicationPID, SIGKILL);
+			waitpid(replicationPID, NULL, 0);
+		}
+	}
+	
+	printf("Goodbye!\n");
 	return 0;
 }
+#endif /* LOGBENCH */
 
 
 /***********************************************************************************************************/
@@ -316,16 +742,31 @@ char * get_timestamp(char *t, time_t mt) {
 
 
 
+/* Writes the beginning of a line of the log file: "<timestamp> | from <address> port <port> --> ". Returns its length */
+int formatHeader(char *header, size_t size, char *time, char *addr, int pn) {
+
+	int length = snprintf(header, size, "%s | from %s port %d --> ", time, addr, pn);
+	
+	// A truncated header is as long as the buffer allows
+	return (length < (int) size) ? length : (int) size - 1;
+}
+
+
+
 /* 
 * This function appends a message to the file specified as an argument only if no other process holds a lock on the file. 
 * In particular, using fcntl(), if another process holds a lock on the file, the caller waits for that process to release
 * the lock, otherwise the function acquires a lock on the entire file, append a string to it, release the lock and terminates.
+* If fields are given (structured mode), they are stored in the column files while the lock is still held.
 */
-int logReceivedMessage(char *pathToFile, char *message, char *time, char *addr, int pn) {
+int logReceivedMessage(char *pathToFile, char *message, char *time, char *addr, int pn, struct logField *fields, int nFields) {
 	
 	int fd;
+	off_t recordOffset;	// position of the line inside the log file (referenced by the column files)
 	struct flock lock;
-	char line[250];		// a single line of the log file
+	char header[HEADERSIZE];	// beginning of the line: timestamp and address of the client
+	struct iovec line[3];		// a single line of the log file: header, message and newline
+	ssize_t lineLength;
 	
 	/*
 	* Opening file
@@ -362,12 +803,33 @@ int logReceivedMessage(char *pathToFile, char *message, char *time, char *addr,
 	
 	// At this point, the lock has been acquired
 	
-	// Craft a single line of the log by concatenating different info
-	sprintf(line, "%s | from %s port %d --> %s\n", time, addr, pn, message);
+	/*
+	* Craft a single line of the log by concatenating different info.
+	* Only the short header is formatted in a local buffer: the message (up to 4 KB after sanitization) is not copied,
+	* writev() takes the three pieces where they are and appends them with a single system call.
+	*/
+	line[0].iov_base = header;
+	line[0].iov_len = formatHeader(header, sizeof(header), time, addr, pn);
+	line[1].iov_base = message;
+	line[1].iov_len = strlen(message);
+	line[2].iov_base = "\n";
+	line[2].iov_len = 1;
+	lineLength = line[0].iov_len + line[1].iov_len + line[2].iov_len;
+	
+	// With O_APPEND the line will be written at the current end of the file (nobody else can write while we hold the lock)
+	recordOffset = lseek(fd, 0, SEEK_END);
 	
 	// Append the line to the log file
-	if (write(fd, line, strlen(line)) == -1) {
-		perror("write() failed");
+	if (writev(fd, line, 3) != lineLength) {
+		perror("writev() failed");
+		close(fd);
+		return -1;
+	}
+	
+	// Store the fields of the record in the column files
+	if (nFields > 0 && storeFields(pathToFile, recordOffset, fields, nFields) == -1) {
+		perror("Error while storing the fields");
+		close(fd);
 		return -1;
 	}
 	
@@ -387,12 +849,13 @@ int logReceivedMessage(char *pathToFile, char *message, char *time, char *addr,
 }
 
 
-/* This function is similar to logReceivedMessage() but takes less arguments. It is used by the signal handler to log the shutdown */
+/* This function is similar to logReceivedMessage() but takes less arguments. It is used by the main loop to log the shutdown or the restart */
 int logMessage(char *pathToFile, char *message, char *time) {
 	
 	int fd;
 	struct flock lock;
-	char line[250];			// a single line of the log file
+	char line[LINESIZE];		// a single line of the log file
+	ssize_t lineLength;
 	
 	// Opening file
 	fd = open(pathToFile, O_WRONLY|O_CREAT|O_APPEND, S_IRUSR|S_IWUSR);
@@ -416,11 +879,13 @@ int logMessage(char *pathToFile, char *message, char *time) {
 	// At this point, the lock has been acquired
 	
 	// Craft a single line of the log by concatenating different info
-	sprintf(line, "%s | %s\n", time, message);
+	snprintf(line, sizeof(line), "%s | %s\n", time, message);
+	lineLength = strlen(line);
 	
 	// Append the line to the log file
-	if (write(fd, line, strlen(line)) == -1) {
+	if (write(fd, line, lineLength) != lineLength) {
 		perror("write() failed");
+		close(fd);
 		return -1;
 	}
 	
@@ -441,31 +906,149 @@ int logMessage(char *pathToFile, char *message, char *time) {
 
 
 
-/* 
-* When the SIGINT signal is received this signal handler will be executed both by the main process and the child
-* processes. However, only the main process will handle the shut down.
-*/
-void shutdown_handler(int signum) {
+/* Adds a child process to the list of the children serving a client. The list grows as needed */
+void addChild(pid_t pid) {
 
-	if (is_main_process == 0) {
-		// The child process will only terminate
-		exit(0);
+	pid_t *newList;
+	
+	if (nChildren % 64 == 0) {
+		if ((newList = realloc(children, (nChildren + 64) * sizeof(pid_t))) == NULL) {
+			perror("realloc() failed");
+			exit(1);
+		}
+		children = newList;
 	}
-	else {
 	
-		time_t mytime;
-		char *t;
-		
-		t = get_timestamp(t, mytime);
+	children[nChildren++] = pid;
+}
+
+
+
+/* Waits for every terminated child process, without blocking, and removes it from the list */
+void reapChildren(void) {
+
+	pid_t pid;
+	
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+	
+		// The replication process terminated by itself: its PID is no longer ours, it must not be signaled at shutdown
+		if (pid == replicationPID) {
+			printf("The replication process terminated\n");
+			replicationPID = 0;
+			continue;
+		}
 		
-		// Record the order of shutdown in the log file (fullpath is a global variable)
-		if (logMessage(fullpath, "The server was shut down", t) == -1) {
-			perror("Error while logging the shutdown message");
-			exit(1);
+		for (int i = 0; i < nChildren; i++) {
+			if (children[i] == pid) {
+				// Replace it with the last element of the list
+				children[i] = children[--nChildren];
+				break;
+			}
 		}
+	}
+}
+
+
+
+/*
+* Hot restart: starts a new server process (same executable and arguments) that inherits the listening socket and
+* continues the current log file. The descriptor of the socket and the log file are passed in environment variables.
+* The new server reports that it is ready by writing on a pipe: only then the caller closes its copy of the socket,
+* so there is no moment in which the connections are refused. If the new server fails, the caller keeps listening.
+* Returns 0 when the new server is ready, -1 on error.
+*/
+int restartServer(char *argv[], int serverSocket) {
+
+	pid_t pid;
+	int readyPipe[2];		// [0] read by this process, [1] written by the new server
+	char fdString[16];
+	char ready;
+	struct pollfd p;
+	sigset_t empty;
+	
+	fflush(stdout);
+	
+	if (pipe(readyPipe) == -1) {
+		perror("pipe() failed");
+		return -1;
+	}
+	
+	// The read end is closed by execv(), the write end is kept by the new server
+	fcntl(readyPipe[0], F_SETFD, FD_CLOEXEC);
+	
+	if ((pid = fork()) < 0) {
+		perror("fork() failed");
+		close(readyPipe[0]);
+		close(readyPipe[1]);
+		return -1;
+	}
+	else if (pid == 0) {
+	
+		snprintf(fdString, sizeof(fdString), "%d", serverSocket);
+		setenv(LISTENFD_ENV, fdString, 1);
+		snprintf(fdString, sizeof(fdString), "%d", readyPipe[1]);
+		setenv(READYFD_ENV, fdString, 1);
+		setenv(LOGFILE_ENV, fullpath, 1);
 		
-		// Use write() instead of printf() because write() is an async-signal-safe function
-		write(1, "\nShutting down the server... Goodbye!\n", 38); // 1 is the file descriptor for stdout
-		exit(0);
+		// The mask of the blocked signals is kept by execv(): the new server starts with an empty one
+		sigemptyset(&empty);
+		sigprocmask(SIG_SETMASK, &empty, NULL);
+		
+		// argv[0] is unchanged, so the new server has the same name (e.g. for pgrep)
+		if (strchr(exePath, '/') != NULL)
+			execv(exePath, argv);
+		else
+			execvp(exePath, argv);
+		perror("execv() failed");
+		exit(1);
 	}
+	
+	close(readyPipe[1]);
+	
+	/*
+	* Wait for the new server. If it terminates first, read() returns 0 (end of file).
+	* In the meantime the new connections wait in the queue of the listening socket.
+	*/
+	p.fd = readyPipe[0];
+	p.events = POLLIN;
+	if (poll(&p, 1, RESTART_TIMEOUT * 1000) <= 0 || read(readyPipe[0], &ready, 1) != 1) {
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		close(readyPipe[0]);
+		return -1;
+	}
+	
+	close(readyPipe[0]);
+	return 0;
+}
+
+
+
+/*
+* Enables the TCP keepalive on a client socket. Without it, a client that disappears without closing the connection
+* (crash, cable unplugged) would keep a child process blocked forever. With these values the kernel notices
+* a dead peer after about KEEPALIVE_IDLE + KEEPALIVE_INTERVAL * KEEPALIVE_COUNT seconds and recv() fails with ETIMEDOUT.
+*/
+int setKeepAlive(int sock) {
+
+	int on = 1, idle = KEEPALIVE_IDLE, interval = KEEPALIVE_INTERVAL, count = KEEPALIVE_COUNT;
+	
+	if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) < 0
+			|| setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) < 0
+			|| setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) < 0
+			|| setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) < 0)
+		return -1;
+	
+	return 0;
+}
+
+
+
+/* Returns the seconds elapsed since an arbitrary point. Unlike time(), it does not jump when the system clock is changed */
+time_t monotonicSeconds(void) {
+
+	struct timespec now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
 }
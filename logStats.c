@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h> 	/* for exit(), qsort() and free() */
+#include <string.h>
+#include <unistd.h>	/* for access() */
+
+#include "logFields.h"	/* for lookupKey() and columnPath() */
+
+#define MAXLOGFILE 5		// maximum number of log files in the given directory (same as the server)
+#define TABLESIZE 4096		// number of slots of the hash table used to count the values (distinct values are capped to this)
+
+/*
+* Counts the values of a field over all the log files of the directory, e.g. "logStats logs status" prints how many
+* records there are for every status code. It needs the server to be started in structured mode (-s): only the
+* dictionary and the column file of the requested key are read, not the log files themselves.
+*/
+
+struct counter {
+	char *value;
+	unsigned long count;
+};
+
+static struct counter table[TABLESIZE];
+static int distinctValues = 0;
+
+// Adds one to the counter of the given value
+static void countValue(const char *value);
+
+// Used by qsort() to order the counters by decreasing count
+static int compareCounters(const void *a, const void *b);
+
+int main(int argc, char *argv[])
+{
+
+	char *directory;
+	char *key;
+	char logPath[300];		// path of the log file
+	char colPath[300];		// path of the column file of the key
+	char line[8192];		// a single line of the column file
+	char *value;
+	FILE *f;
+	int i, id;
+	unsigned long records = 0;	// number of records that contain the key
+
+	/* Check correct number of arguments */
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <directory> <key>\n", argv[0]);
+		exit(1);
+	}
+
+	directory = argv[1];
+	key = argv[2];
+
+	for (i = 0; i <= MAXLOGFILE; i++) {
+
+		snprintf(logPath, sizeof(logPath), "%s/server_%d.log", directory, i);
+
+		// Skip the log files that do not exist or do not contain the key
+		if (access(logPath, F_OK) == -1 || (id = lookupKey(logPath, key)) == -1)
+			continue;
+
+		columnPath(colPath, sizeof(colPath), logPath, id);
+		if ((f = fopen(colPath, "r")) == NULL) {
+			perror("Error opening the column file");
+			continue;
+		}
+
+		// Every line is "<offset> <value>"
+		while (fgets(line, sizeof(line), f) != NULL) {
+			line[strcspn(line, "\n")] = '\0';
+			value = strchr(line, ' ');
+			countValue(value != NULL ? value + 1 : "");
+			records++;
+		}
+
+		fclose(f);
+	}
+
+	// Print the values ordered by decreasing count
+	qsort(table, TABLESIZE, sizeof(struct counter), compareCounters);
+	for (i = 0; i < distinctValues; i++) {
+		printf("%10lu  %s\n", table[i].count, table[i].value);
+		free(table[i].value);
+	}
+
+	printf("%10lu  records with key '%s'\n", records, key);
+
+	return 0;
+}
+
+
+/* Adds one to the counter of the given value (hash table with linear probing, FNV-1a hash) */
+static void countValue(const char *value) {
+
+	unsigned int h = 2166136261u;
+
+	for (const char *c = value; *c != '\0'; c++)
+		h = (h ^ (unsigned char) *c) * 16777619u;
+
+	for (unsigned int i = 0; i < TABLESIZE; i++) {
+		struct counter *slot = &table[(h + i) % TABLESIZE];
+
+		if (slot->value == NULL) {
+			if ((slot->value = strdup(value)) == NULL) {
+				perror("strdup() failed");
+				exit(1);
+			}
+			slot->count = 1;
+			distinctValues++;
+			return;
+		}
+		if (strcmp(slot->value, value) == 0) {
+			slot->count++;
+			return;
+		}
+	}
+
+	// The table is full: the value is only counted in the total
+}
+
+
+/* Used by qsort() to order the counters by decreasing count (empty slots go at the end) */
+static int compareCounters(const void *a, const void *b) {
+
+	const struct counter *x = a, *y = b;
+
+	if (x->value == NULL || y->value == NULL)
+		return (x->value == NULL) - (y->value == NULL);
+	if (x->count != y->count)
+		return (x->count < y->count) ? 1 : -1;
+	return strcmp(x->value, y->value);
+}
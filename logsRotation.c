@@ -8,15 +8,18 @@
 
 #define THRESHOLD 20	// threshold for the size of every log file
 #define MAXLOGFILE 4	// maximum number of possible log files inside the directory
+#define PATHSIZE 50	// size of the buffers that contain the path of a log file
 
 int sizeExceedThreshold(char *f_name, int n_bytes, unsigned int th);
-char * findMostRecentFile(char *directory);
+char * findMostRecentFile(char *directory, char *mostRecentFile);
 int rotateLogs(char * dir, int maxLogs);
 
+/* main() is left out when the functions of this file are linked into the benchmarks (see the Makefile) */
+#ifndef LOGBENCH
 int main(int argc, char *argv[]) {
 
-	char *mostRecentFile;
-	char *fullpath = malloc(50);
+	char mostRecentFile[PATHSIZE];
+	char fullpath[PATHSIZE];
 	int ret;
 	int j;
 	int fd, new_fd;
@@ -31,7 +34,7 @@ int main(int argc, char *argv[]) {
 	directory = argv[1];
 	
 	// When the server starts it has to write on the most recent file
-	mostRecentFile = findMostRecentFile(directory);
+	findMostRecentFile(directory, mostRecentFile);
 	
 	printf("[DEBUG] most recent file is: %s\n", mostRecentFile);
 	
@@ -55,7 +58,7 @@ int main(int argc, char *argv[]) {
 			* Concatenate the given directory path with the name of the log file.
 			* The function sprintf(), instead of printing on stdout, stores the string into the specified buffer.
 			*/
-			sprintf(fullpath, "%s/server_%d.log", directory, j);
+			snprintf(fullpath, sizeof(fullpath), "%s/server_%d.log", directory, j);
 			
 			// Test for the file existence (F_OK): if it does not exist then we found a name for a new log file
 			if ((access(fullpath, F_OK)) == -1) {
@@ -97,10 +100,9 @@ int main(int argc, char *argv[]) {
 	}
 	
 	
-	free(fullpath);
-	
 return 0;
 }
+#endif /* LOGBENCH */
 
 
 
@@ -123,6 +125,13 @@ int sizeExceedThreshold(char *f_name, int n_bytes, unsigned int th) {
 	// fstat() returns info about the file, in the struct file_info
 	if ((fstat(fd, &file_info)) == -1) {
 		perror("fstat() failed");
+		close(fd);
+		return -1;
+	}
+	
+	// The descriptor is not needed anymore: close it before returning, whatever the result
+	if ((close(fd)) == -1) {
+		perror("close failed");
 		return -1;
 	}
 	
@@ -132,22 +141,19 @@ int sizeExceedThreshold(char *f_name, int n_bytes, unsigned int th) {
 		// Return 1 if exceed the given threshold
 		return 1;
 	
-	if ((close(fd)) == -1) {
-		perror("close failed");
-		return -1;
-	}
-	
 	// Returns 0 if don't exceed the threshold
 	return 0;
 }
 
 
 
-/* This function takes a directory as argument and returns the name of the most recent file inside the directory */
-char * findMostRecentFile(char *directory) {
+/*
+* This function takes a directory as argument and returns the name of the most recent file inside the directory.
+* The name is written in the buffer given by the caller (at least PATHSIZE bytes), so nothing has to be freed.
+*/
+char * findMostRecentFile(char *directory, char *mostRecentFile) {
 
 	DIR *d;
-	char *mostRecentFile = malloc(50);
 	int fd;
 
 	d = opendir(directory);
@@ -163,10 +169,14 @@ char * findMostRecentFile(char *directory) {
 		printf("[+] Directory \'%s\' successfully created.\n", directory);
 		
 		// The directory is empty, so we create a log file
-		sprintf(mostRecentFile, "%s/%s", directory, "server_1.log");
+		snprintf(mostRecentFile, PATHSIZE, "%s/%s", directory, "server_1.log");
 		return mostRecentFile;
 	}
 	else {
+	
+		// We only need to know that the directory exists
+		closedir(d);
+		
 		/* 
 		* The directory exists, we need to search for the most recent file.
 		* The most recent file will always be the last one (the one with the highest number), 
@@ -174,7 +184,7 @@ char * findMostRecentFile(char *directory) {
 		*/
 		for (int i=MAXLOGFILE; i>0; i--) {
 		
-			sprintf(mostRecentFile, "%s/server_%d.log", directory, i);
+			snprintf(mostRecentFile, PATHSIZE, "%s/server_%d.log", directory, i);
 			
 			// Check the existence of the file: if it exists then we found the most recent file
 			if ((access(mostRecentFile, F_OK)) == 0) 
@@ -188,6 +198,8 @@ char * findMostRecentFile(char *directory) {
 		* it is empty, then at the end of the for loop 'mostRecentFile' contains 'server_1.log' and we create it.
 		*/
 		fd = open(mostRecentFile, O_WRONLY|O_CREAT|O_APPEND, S_IRUSR|S_IWUSR);
+		if (fd != -1)
+			close(fd);
 		return mostRecentFile;
 	}
 